@@ -0,0 +1,291 @@
+#include <Urho3D/Urho3D.h>
+
+#include "BoidKernels.h"
+
+#if defined(URHO3D_SSE) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+#define BOIDS_SSE2
+#include <emmintrin.h>
+#if defined(_MSC_VER) || defined(__GNUC__)
+#define BOIDS_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BOIDS_TARGET_AVX2
+#else
+#define BOIDS_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#endif
+#endif
+
+void SortedFlock::Build(const Vector3* positions, const Vector3* velocities, const PODVector<unsigned>& order)
+{
+	unsigned count = order.Size();
+	px.Resize(count);
+	py.Resize(count);
+	pz.Resize(count);
+	vx.Resize(count);
+	vy.Resize(count);
+	vz.Resize(count);
+
+	for (unsigned i = 0; i < count; ++i)
+	{
+		const Vector3& p = positions[order[i]];
+		const Vector3& v = velocities[order[i]];
+		px[i] = p.x_;
+		py[i] = p.y_;
+		pz[i] = p.z_;
+		vx[i] = v.x_;
+		vy[i] = v.y_;
+		vz[i] = v.z_;
+	}
+}
+
+/// Scalar reference kernel, also used for the tail of each run by the vector kernels.
+static inline void AccumulateScalar(const SortedFlock& flock, unsigned begin, unsigned end, const Vector3& position,
+	const SteeringRadii& radii, SteeringSums& sums)
+{
+	for (unsigned k = begin; k < end; ++k)
+	{
+		float dx = position.x_ - flock.px[k];
+		float dy = position.y_ - flock.py[k];
+		float dz = position.z_ - flock.pz[k];
+		float distance2 = dx * dx + dy * dy + dz * dz;
+		if (distance2 >= radii.attract2)
+			continue;
+
+		sums.centerOfMass += Vector3(flock.px[k], flock.py[k], flock.pz[k]);
+		sums.heading += Vector3(flock.vx[k], flock.vy[k], flock.vz[k]);
+		sums.numNeighbours++;
+
+		if (distance2 < radii.repel2 && distance2 > 0.0f)
+		{
+			float invDistance = 1.0f / sqrtf(distance2);
+			sums.repel += Vector3(dx * invDistance, dy * invDistance, dz * invDistance);
+		}
+	}
+}
+
+static void SteerScalar(const SortedFlock& flock, const GridRange* ranges, unsigned numRanges, const Vector3& position,
+	const SteeringRadii& radii, SteeringSums& sums)
+{
+	for (unsigned r = 0; r < numRanges; ++r)
+		AccumulateScalar(flock, ranges[r].begin, ranges[r].end, position, radii, sums);
+}
+
+#ifdef BOIDS_SSE2
+static inline float HorizontalSum(__m128 v)
+{
+	__m128 shuffled = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+	__m128 sum = _mm_add_ps(v, shuffled);
+	shuffled = _mm_movehl_ps(shuffled, sum);
+	return _mm_cvtss_f32(_mm_add_ss(sum, shuffled));
+}
+
+static void SteerSSE2(const SortedFlock& flock, const GridRange* ranges, unsigned numRanges, const Vector3& position,
+	const SteeringRadii& radii, SteeringSums& sums)
+{
+	const __m128 x = _mm_set1_ps(position.x_);
+	const __m128 y = _mm_set1_ps(position.y_);
+	const __m128 z = _mm_set1_ps(position.z_);
+	const __m128 attract2 = _mm_set1_ps(radii.attract2);
+	const __m128 repel2 = _mm_set1_ps(radii.repel2);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 three = _mm_set1_ps(3.0f);
+
+	__m128 comX = zero, comY = zero, comZ = zero;
+	__m128 headX = zero, headY = zero, headZ = zero;
+	__m128 repX = zero, repY = zero, repZ = zero;
+	__m128 count = zero;
+
+	for (unsigned r = 0; r < numRanges; ++r)
+	{
+		unsigned k = ranges[r].begin;
+		unsigned end = ranges[r].end;
+
+		for (; k + 4 <= end; k += 4)
+		{
+			__m128 ox = _mm_loadu_ps(&flock.px[k]);
+			__m128 oy = _mm_loadu_ps(&flock.py[k]);
+			__m128 oz = _mm_loadu_ps(&flock.pz[k]);
+			__m128 dx = _mm_sub_ps(x, ox);
+			__m128 dy = _mm_sub_ps(y, oy);
+			__m128 dz = _mm_sub_ps(z, oz);
+			__m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+			__m128 inAttract = _mm_cmplt_ps(distance2, attract2);
+			if (!_mm_movemask_ps(inAttract))
+				continue;
+
+			comX = _mm_add_ps(comX, _mm_and_ps(inAttract, ox));
+			comY = _mm_add_ps(comY, _mm_and_ps(inAttract, oy));
+			comZ = _mm_add_ps(comZ, _mm_and_ps(inAttract, oz));
+			headX = _mm_add_ps(headX, _mm_and_ps(inAttract, _mm_loadu_ps(&flock.vx[k])));
+			headY = _mm_add_ps(headY, _mm_and_ps(inAttract, _mm_loadu_ps(&flock.vy[k])));
+			headZ = _mm_add_ps(headZ, _mm_and_ps(inAttract, _mm_loadu_ps(&flock.vz[k])));
+			count = _mm_add_ps(count, _mm_and_ps(inAttract, one));
+
+			__m128 inRepel = _mm_and_ps(_mm_cmplt_ps(distance2, repel2), _mm_cmpgt_ps(distance2, zero));
+			if (!_mm_movemask_ps(inRepel))
+				continue;
+
+			// Reciprocal square root refined with one Newton-Raphson step; masked lanes may hold inf or NaN
+			__m128 estimate = _mm_rsqrt_ps(distance2);
+			__m128 invDistance = _mm_mul_ps(_mm_mul_ps(half, estimate),
+				_mm_sub_ps(three, _mm_mul_ps(_mm_mul_ps(distance2, estimate), estimate)));
+			repX = _mm_add_ps(repX, _mm_and_ps(inRepel, _mm_mul_ps(dx, invDistance)));
+			repY = _mm_add_ps(repY, _mm_and_ps(inRepel, _mm_mul_ps(dy, invDistance)));
+			repZ = _mm_add_ps(repZ, _mm_and_ps(inRepel, _mm_mul_ps(dz, invDistance)));
+		}
+
+		AccumulateScalar(flock, k, end, position, radii, sums);
+	}
+
+	sums.centerOfMass += Vector3(HorizontalSum(comX), HorizontalSum(comY), HorizontalSum(comZ));
+	sums.heading += Vector3(HorizontalSum(headX), HorizontalSum(headY), HorizontalSum(headZ));
+	sums.repel += Vector3(HorizontalSum(repX), HorizontalSum(repY), HorizontalSum(repZ));
+	sums.numNeighbours += (int)HorizontalSum(count);
+}
+#endif
+
+#ifdef BOIDS_AVX2
+BOIDS_TARGET_AVX2 static inline float HorizontalSum256(__m256 v)
+{
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	__m128 shuffled = _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(2, 3, 0, 1));
+	sum = _mm_add_ps(sum, shuffled);
+	shuffled = _mm_movehl_ps(shuffled, sum);
+	return _mm_cvtss_f32(_mm_add_ss(sum, shuffled));
+}
+
+BOIDS_TARGET_AVX2 static void SteerAVX2(const SortedFlock& flock, const GridRange* ranges, unsigned numRanges,
+	const Vector3& position, const SteeringRadii& radii, SteeringSums& sums)
+{
+	const __m256 x = _mm256_set1_ps(position.x_);
+	const __m256 y = _mm256_set1_ps(position.y_);
+	const __m256 z = _mm256_set1_ps(position.z_);
+	const __m256 attract2 = _mm256_set1_ps(radii.attract2);
+	const __m256 repel2 = _mm256_set1_ps(radii.repel2);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 three = _mm256_set1_ps(3.0f);
+
+	__m256 comX = zero, comY = zero, comZ = zero;
+	__m256 headX = zero, headY = zero, headZ = zero;
+	__m256 repX = zero, repY = zero, repZ = zero;
+	__m256 count = zero;
+
+	for (unsigned r = 0; r < numRanges; ++r)
+	{
+		unsigned k = ranges[r].begin;
+		unsigned end = ranges[r].end;
+
+		for (; k + 8 <= end; k += 8)
+		{
+			__m256 ox = _mm256_loadu_ps(&flock.px[k]);
+			__m256 oy = _mm256_loadu_ps(&flock.py[k]);
+			__m256 oz = _mm256_loadu_ps(&flock.pz[k]);
+			__m256 dx = _mm256_sub_ps(x, ox);
+			__m256 dy = _mm256_sub_ps(y, oy);
+			__m256 dz = _mm256_sub_ps(z, oz);
+			__m256 distance2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+
+			__m256 inAttract = _mm256_cmp_ps(distance2, attract2, _CMP_LT_OQ);
+			if (!_mm256_movemask_ps(inAttract))
+				continue;
+
+			comX = _mm256_add_ps(comX, _mm256_and_ps(inAttract, ox));
+			comY = _mm256_add_ps(comY, _mm256_and_ps(inAttract, oy));
+			comZ = _mm256_add_ps(comZ, _mm256_and_ps(inAttract, oz));
+			headX = _mm256_add_ps(headX, _mm256_and_ps(inAttract, _mm256_loadu_ps(&flock.vx[k])));
+			headY = _mm256_add_ps(headY, _mm256_and_ps(inAttract, _mm256_loadu_ps(&flock.vy[k])));
+			headZ = _mm256_add_ps(headZ, _mm256_and_ps(inAttract, _mm256_loadu_ps(&flock.vz[k])));
+			count = _mm256_add_ps(count, _mm256_and_ps(inAttract, one));
+
+			__m256 inRepel = _mm256_and_ps(_mm256_cmp_ps(distance2, repel2, _CMP_LT_OQ),
+				_mm256_cmp_ps(distance2, zero, _CMP_GT_OQ));
+			if (!_mm256_movemask_ps(inRepel))
+				continue;
+
+			__m256 estimate = _mm256_rsqrt_ps(distance2);
+			__m256 invDistance = _mm256_mul_ps(_mm256_mul_ps(half, estimate),
+				_mm256_fnmadd_ps(_mm256_mul_ps(distance2, estimate), estimate, three));
+			repX = _mm256_add_ps(repX, _mm256_and_ps(inRepel, _mm256_mul_ps(dx, invDistance)));
+			repY = _mm256_add_ps(repY, _mm256_and_ps(inRepel, _mm256_mul_ps(dy, invDistance)));
+			repZ = _mm256_add_ps(repZ, _mm256_and_ps(inRepel, _mm256_mul_ps(dz, invDistance)));
+		}
+
+		AccumulateScalar(flock, k, end, position, radii, sums);
+	}
+
+	sums.centerOfMass += Vector3(HorizontalSum256(comX), HorizontalSum256(comY), HorizontalSum256(comZ));
+	sums.heading += Vector3(HorizontalSum256(headX), HorizontalSum256(headY), HorizontalSum256(headZ));
+	sums.repel += Vector3(HorizontalSum256(repX), HorizontalSum256(repY), HorizontalSum256(repZ));
+	sums.numNeighbours += (int)HorizontalSum256(count);
+}
+
+static bool CpuSupportsAVX2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// AVX and FMA instructions, plus OS support for saving the YMM registers
+	__cpuid(info, 1);
+	const int fmaAvxOsxsave = (1 << 12) | (1 << 27) | (1 << 28);
+	if ((info[2] & fmaAvxOsxsave) != fmaAvxOsxsave)
+		return false;
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+#endif
+
+SteeringKernel GetSteeringKernel(SteeringKernelType type)
+{
+	switch (type)
+	{
+	case KERNEL_SCALAR:
+		return SteerScalar;
+
+#ifdef BOIDS_SSE2
+	case KERNEL_SSE2:
+		return SteerSSE2;
+#endif
+
+#ifdef BOIDS_AVX2
+	case KERNEL_AVX2:
+		return CpuSupportsAVX2() ? SteerAVX2 : 0;
+#endif
+
+	default:
+		return 0;
+	}
+}
+
+SteeringKernelType GetBestSteeringKernelType()
+{
+	for (int type = MAX_KERNEL_TYPES - 1; type > KERNEL_SCALAR; --type)
+	{
+		if (GetSteeringKernel((SteeringKernelType)type))
+			return (SteeringKernelType)type;
+	}
+
+	return KERNEL_SCALAR;
+}
+
+const char* GetSteeringKernelName(SteeringKernelType type)
+{
+	static const char* names[] = { "Scalar", "SSE2", "AVX2" };
+	return type < MAX_KERNEL_TYPES ? names[type] : "Unknown";
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector3.h>
+
+#include "SpatialGrid.h"
+
+using namespace Urho3D;
+
+/// Neighbour sums for one boid, gathered by the steering kernels.
+struct SteeringSums
+{
+	Vector3 centerOfMass;
+	Vector3 heading;
+	Vector3 repel;
+	int numNeighbours;
+};
+
+/// Squared rule radii passed to the steering kernels.
+struct SteeringRadii
+{
+	float attract2;
+	float repel2;
+};
+
+/// Flock positions and velocities copied into the grid's cell-sorted order as separate float streams, so every run
+/// returned by SpatialGrid::QueryRanges is contiguous and can be loaded several lanes at a time.
+struct SortedFlock
+{
+	void Build(const Vector3* positions, const Vector3* velocities, const PODVector<unsigned>& order);
+
+	PODVector<float> px;
+	PODVector<float> py;
+	PODVector<float> pz;
+	PODVector<float> vx;
+	PODVector<float> vy;
+	PODVector<float> vz;
+};
+
+enum SteeringKernelType
+{
+	KERNEL_SCALAR = 0,
+	KERNEL_SSE2,
+	KERNEL_AVX2,
+	MAX_KERNEL_TYPES
+};
+
+/// Accumulate the neighbour sums of one boid over a set of grid runs. Every point within the attraction radius
+/// counts, including the boid itself, which the caller subtracts afterwards.
+typedef void (*SteeringKernel)(const SortedFlock& flock, const GridRange* ranges, unsigned numRanges,
+	const Vector3& position, const SteeringRadii& radii, SteeringSums& sums);
+
+/// Return the kernel of a type, or null if it was not compiled in or the running CPU lacks the instructions.
+SteeringKernel GetSteeringKernel(SteeringKernelType type);
+/// Return the widest kernel type the running CPU supports.
+SteeringKernelType GetBestSteeringKernelType();
+/// Return a kernel type's name for logging.
+const char* GetSteeringKernelName(SteeringKernelType type);
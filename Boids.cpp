@@ -1,212 +1,763 @@
+#include <Urho3D/Core/Profiler.h>
+#include <Urho3D/IO/Log.h>
+
 #include "Boids.h"
+#include "FlockManager.h"
 
-float Boid::Range_FAttract = 30.0f;
-float Boid::Range_FRepel = 20.0f;
-float Boid::Range_FAlign = 5.0f;
-float Boid::FAttract_Vmax = 5.0f;
-float Boid::FAttract_Factor = 4.0f;
-float Boid::FRepel_Factor = 2.0f;
-float Boid::FAlign_Factor = 2.0f;
+/// Boids per work item. Small enough to balance across threads, large enough to amortise queueing.
+static const unsigned BOIDS_PER_BATCH = 128;
+/// Fish drawn by one StaticModelGroup. Bounds the group's bounding box so distant schools can still be culled.
+static const unsigned BOIDS_PER_GROUP = 256;
 
-void Boid::Initialise(ResourceCache *pRes, Scene *pScene)
+void Boid::Initialise(Scene *pScene, Model* model, StaticModelGroup* group, BoidCollisionMode collisionMode)
 {
-	pNode = pScene->CreateChild("Boid");
+	// Fish state reaches clients in flock snapshots, so the nodes themselves are never replicated
+	pNode = pScene->CreateChild("Boid", LOCAL);
 	pNode->SetPosition(Vector3(0.0f, 0.0f, 0.0f));
 	pNode->SetRotation(Quaternion(0.0f, 0.0f, 0.0f));
 	pNode->SetScale(Vector3(0.005f, 0.005f, 0.005f));
 
-	pObject = pNode->CreateComponent<StaticModel>();
-	pObject->SetModel(pRes->GetResource<Model>("Models/TropicalFish12.mdl"));
-	pObject->SetMaterial(pRes->GetResource<Material>("Materials/Fish.xml"));
-	pObject->SetCastShadows(true);
-	pObject->SetDrawDistance(100);
+	pGroup = group;
+
+	if (collisionMode != BOID_COLLISION_NONE)
+	{
+		pRigidBody = pNode->CreateComponent<RigidBody>();
+		pRigidBody->SetCollisionLayer(3);
+		pRigidBody->SetUseGravity(false);
+		pRigidBody->SetMass(1.0f);
+		// BoidSet integrates the motion; the body only follows the node so the fish still collide
+		pRigidBody->SetKinematic(true);
+
+		pCollisionShape = pNode->CreateComponent<CollisionShape>();
+		if (collisionMode == BOID_COLLISION_SPHERE)
+		{
+			// Sphere around the model bounds, in model space; the shape is scaled with the node
+			const BoundingBox& bounds = model->GetBoundingBox();
+			Vector3 size = bounds.Size();
+			pCollisionShape->SetSphere(Max(size.x_, Max(size.y_, size.z_)), bounds.Center());
+		}
+		else
+			pCollisionShape->SetTriangleMesh(model, 0);
+	}
+
+	pNode->SetEnabled(false);
+}
 
-	pRigidBody = pNode->CreateComponent<RigidBody>();
-	pRigidBody->SetCollisionLayer(3);
-	pRigidBody->SetUseGravity(false);
-	pRigidBody->SetMass(1.0f);
-	pRigidBody->SetPosition(Vector3(Random(180.0f) - 90.0f, Random(180.0f) - 0.0f, Random(180.0f) - 90.0f));
-	pRigidBody->SetLinearVelocity(Vector3(Random(-20.0f) - 20.0f, 0, Random(-20.0f) - 20.0f));
+void Boid::Spawn(const Vector3& position, const Vector3& velocity)
+{
+	SetTransform(position, HeadingRotation(velocity));
+	pNode->SetEnabled(true);
+	pGroup->AddInstanceNode(pNode);
+}
 
-	pCollisionShape = pNode->CreateComponent<CollisionShape>();
-	pCollisionShape->SetTriangleMesh(pObject->GetModel(), 0);
+void Boid::Despawn()
+{
+	pGroup->RemoveInstanceNode(pNode);
+	pNode->SetEnabled(false);
 }
 
-void Boid::ComputeForce(Boid *pBoidList)
+void Boid::SetTransform(const Vector3& position, const Quaternion& rotation)
 {
-	ComputeAttraction(pBoidList);
-	ComputeAlignment(pBoidList);
-	ComputeSeparation(pBoidList);
+	pNode->SetTransform(position, rotation);
 }
 
-void Boid::ComputeSeparation(Boid *pBoidList)
+Vector3 Boid::ComputeForce(const SteeringSums& sums, const Vector3& position, const Vector3& velocity,
+	const BoidParameters& parameters)
 {
-	int n = 0;
+	Vector3 force(0, 0, 0);
 
-	for (int i = 0; i < 60; i++)
+	if (sums.numNeighbours > 0)
 	{
-		if (this == &pBoidList[i])
-			continue;
+		// Attraction towards the local centre of mass
+		Vector3 CenterOfMass = sums.centerOfMass / sums.numNeighbours;
+		Vector3 dir = (CenterOfMass - position).Normalized();
+		Vector3 vDesired = dir * parameters.attractVmax;
+		force += (vDesired - velocity) * parameters.attractFactor;
+
+		// Alignment with the local average heading
+		Vector3 heading = sums.heading / sums.numNeighbours;
+		heading.Normalize();
+		force += (heading - velocity) * parameters.alignFactor;
+	}
+
+	force += sums.repel * parameters.repelFactor;
+	return force;
+}
+
+void Boid::Integrate(Vector3& position, Vector3& velocity, const Vector3& force, float timeStep,
+	const BoidParameters& parameters)
+{
+	velocity += force * timeStep;
+
+	float d = velocity.Length();
+	if (d < parameters.minSpeed)
+		velocity = velocity.Normalized() * parameters.minSpeed;
+	else if (d > parameters.maxSpeed)
+		velocity = velocity.Normalized() * parameters.maxSpeed;
+
+	position += velocity * timeStep;
+	position.y_ = Clamp(position.y_, parameters.minHeight, parameters.maxHeight);
+}
+
+Quaternion Boid::HeadingRotation(const Vector3& velocity)
+{
+	Vector3 vn = velocity.Normalized();
+	Vector3 cp = -vn.CrossProduct(Vector3(0.0f, 1.0f, 0.0f));
+	float dp = cp.DotProduct(vn);
+	return Quaternion(Acos(dp), cp);
+}
+
+void BoidSet::DrawDebugInfo()
+{
+	const FlockState& state = GetState();
+	for (unsigned i = 0; i < state.Size(); i++)
+	{
+		debug->AddLine(state.position[i], Boid::HeadingRotation(state.velocity[i]).EulerAngles().FORWARD, Color::BLUE, true);
+	}
+}
+
+void BoidSet::Initialise(ResourceCache *pRes, Scene *pScene, DebugRenderer* debug, unsigned capacity,
+	BoidCollisionMode collisionMode)
+{
+	this->debug = debug;
+	this->collisionMode = collisionMode;
+
+	states[0].Reserve(capacity);
+	states[1].Reserve(capacity);
+	active.Reserve(capacity);
+	grid.SetCellSize(parameters.GetNeighbourRange());
+	SetKernel(GetBestSteeringKernelType());
+	workQueue = pScene->GetSubsystem<WorkQueue>();
 
-		Vector3 position = pRigidBody->GetPosition();
-		Vector3 currBoidPos = pBoidList[i].pRigidBody->GetPosition();
+	Initialized = true;
+
+	CreateGroups(pRes, pScene, capacity);
+	Model* model = pRes->GetResource<Model>("Models/TropicalFish12.mdl");
+
+	boidList.Resize(capacity);
+	activeIndex.Resize(capacity);
+	freeList.Resize(capacity);
+	for (unsigned i = 0; i < capacity; i++)
+	{
+		boidList[i].Initialise(pScene, model, groups[i / BOIDS_PER_GROUP], collisionMode);
+		activeIndex[i] = M_MAX_UNSIGNED;
+		// Hand out low handles first
+		freeList[i] = capacity - 1 - i;
+	}
+}
+
+void BoidSet::CreateGroups(ResourceCache *pRes, Scene *pScene, unsigned capacity)
+{
+	// One instanced drawable per group of fish instead of a StaticModel, and an octree update, per fish
+	Node* flockNode = pScene->CreateChild("Flock", LOCAL);
+	unsigned numGroups = (capacity + BOIDS_PER_GROUP - 1) / BOIDS_PER_GROUP;
+	groups.Resize(numGroups);
+	for (unsigned i = 0; i < numGroups; i++)
+	{
+		StaticModelGroup* group = flockNode->CreateComponent<StaticModelGroup>();
+		group->SetModel(pRes->GetResource<Model>("Models/TropicalFish12.mdl"));
+		group->SetMaterial(pRes->GetResource<Material>("Materials/Fish.xml"));
+		group->SetCastShadows(true);
+		group->SetDrawDistance(100);
+		groups[i] = group;
+	}
+}
 
-		Vector3 separation = position - currBoidPos;
-		float deltaSeparation = separation.Length();
+unsigned BoidSet::Spawn(unsigned count, PODVector<BoidHandle>* handles)
+{
+	count = Min(count, freeList.Size());
 
-		if (deltaSeparation < Range_FRepel)
+	for (unsigned i = 0; i < count; i++)
+	{
+		BoidHandle handle = freeList.Back();
+		freeList.Pop();
+
+		unsigned index = active.Size();
+		active.Push(handle);
+		activeIndex[handle] = index;
+
+		// The flock's own generator rather than the global one, so a copy of the flock spawns the same fish
+		float x = NextRandom(180.0f);
+		float y = NextRandom(180.0f);
+		float z = NextRandom(180.0f);
+		Vector3 position(x - 90.0f, y, z - 90.0f);
+		float vx = NextRandom(20.0f);
+		float vz = NextRandom(20.0f);
+		Vector3 velocity(-vx - 20.0f, 0.0f, -vz - 20.0f);
+		boidList[handle].Spawn(position, velocity);
+
+		lodTiers.Resize(index + 1);
+		lodTiers[index] = BOID_LOD_FULL;
+
+		// Seed both buffers so the fish has a defined previous state before its first step
+		for (unsigned j = 0; j < 2; j++)
 		{
-			if ((deltaSeparation > 0) && deltaSeparation < 100)
-			{
-				Vector3 diff = Vector3(0, 0, 0);
-				diff = position - currBoidPos;
-				diff.Normalize();
-				force += diff * FRepel_Factor;
-				n++;
-			}
+			FlockState& state = states[j];
+			state.Resize(index + 1);
+			state.position[index] = position;
+			state.velocity[index] = velocity;
+			state.force[index] = Vector3::ZERO;
 		}
+
+		if (handles)
+			handles->Push(handle);
+	}
+
+	if (count)
+	{
+		UpdateBatches();
+		if (manager)
+			manager->RecordEvent(this, FLOCK_EVENT_SPAWN, count);
+	}
+	return count;
+}
+
+bool BoidSet::Despawn(BoidHandle handle)
+{
+	if (handle >= activeIndex.Size() || activeIndex[handle] == M_MAX_UNSIGNED)
+		return false;
+
+	// Swap the last active fish into the hole so the flock arrays stay packed
+	unsigned index = activeIndex[handle];
+	if (manager)
+		manager->RecordEvent(this, FLOCK_EVENT_DESPAWN, index);
+	unsigned last = active.Size() - 1;
+	if (index != last)
+	{
+		BoidHandle moved = active[last];
+		active[index] = moved;
+		activeIndex[moved] = index;
+		states[0].Move(last, index);
+		states[1].Move(last, index);
+		lodTiers[index] = lodTiers[last];
+	}
+	active.Pop();
+	lodTiers.Resize(last);
+	states[0].Resize(last);
+	states[1].Resize(last);
+
+	activeIndex[handle] = M_MAX_UNSIGNED;
+	freeList.Push(handle);
+	boidList[handle].Despawn();
+
+	UpdateBatches();
+	return true;
+}
+
+void BoidSet::UpdateBatches()
+{
+	// Flock indices and batch bounds have moved, so the cached lists no longer apply
+	neighbourListsDirty = true;
+
+	unsigned count = active.Size();
+	unsigned numBatches = (count + BOIDS_PER_BATCH - 1) / BOIDS_PER_BATCH;
+	batches.Resize(numBatches);
+	for (unsigned i = 0; i < numBatches; i++)
+	{
+		batches[i].begin = i * BOIDS_PER_BATCH;
+		batches[i].end = Min((i + 1) * BOIDS_PER_BATCH, count);
+	}
+}
+
+void BoidSet::SetReplicatedState(const Vector3* positions, const Vector3* velocities, unsigned count)
+{
+	unsigned oldCount = active.Size();
+	if (count > oldCount)
+		Spawn(count - oldCount);
+	while (active.Size() > count)
+		Despawn(active.Back());
+	count = active.Size();
+
+	// The received state becomes the latest, the one shown before it the previous
+	current ^= 1;
+	FlockState& latest = states[current];
+	FlockState& previous = states[current ^ 1];
+	for (unsigned i = 0; i < count; i++)
+	{
+		latest.position[i] = positions[i];
+		latest.velocity[i] = velocities[i];
+		latest.force[i] = Vector3::ZERO;
 	}
+	// Newly shown fish have nothing to interpolate from
+	for (unsigned i = oldCount; i < count; i++)
+	{
+		previous.position[i] = positions[i];
+		previous.velocity[i] = velocities[i];
+	}
+}
 
-	if (n > 0)
+void BoidSet::SetExactState(unsigned first, const Vector3* positions, const Vector3* velocities, unsigned count)
+{
+	count = Min(count, active.Size() - Min(first, active.Size()));
+	for (unsigned j = 0; j < 2; j++)
 	{
+		FlockState& state = states[j];
+		for (unsigned i = 0; i < count; i++)
+		{
+			state.position[first + i] = positions[i];
+			state.velocity[first + i] = velocities[i];
+			state.force[first + i] = Vector3::ZERO;
+		}
+	}
+}
 
+void BoidSet::SetStepRate(float stepsPerSecond)
+{
+	stepTime = 1.0f / Max(stepsPerSecond, 1.0f);
+}
+
+void BoidSet::SetParameters(const BoidParameters& parameters)
+{
+	this->parameters = parameters;
+	grid.SetCellSize(parameters.GetNeighbourRange());
+	neighbourListsDirty = true;
+}
+
+void BoidSet::SetKernel(SteeringKernelType type)
+{
+	kernel = GetSteeringKernel(type);
+	kernelType = type;
+	if (!kernel)
+	{
+		URHO3D_LOGWARNING(String("Steering kernel ") + GetSteeringKernelName(type) + " not supported, using scalar");
+		kernel = GetSteeringKernel(KERNEL_SCALAR);
+		kernelType = KERNEL_SCALAR;
 	}
+	else
+		URHO3D_LOGINFO(String("Using ") + GetSteeringKernelName(type) + " steering kernel");
 }
 
-void Boid::ComputeAlignment(Boid *pBoidList)
+static void StepBatchWork(const WorkItem* item, unsigned threadIndex)
 {
-	int n = 0;
-	Vector3 sum = Vector3(0, 0, 0);
+	BoidSet* boidSet = reinterpret_cast<BoidSet*>(item->aux_);
+	FlockBatch* batch = reinterpret_cast<FlockBatch*>(item->start_);
+	boidSet->StepBatch(*batch);
+}
+
+void BoidSet::StepBatch(FlockBatch& batch)
+{
+	const FlockState& previous = states[current];
+	FlockState& next = states[current ^ 1];
+	unsigned reducedInterval = Max(lodSettings.reducedInterval, 1u);
+
+	if (rebuildNeighbourLists)
+		BuildNeighbourLists(batch);
 
-	for (int i = 0; i < 60; i++)
+	// One batched lookup for the whole slice; cheaper than the drift and reduced fish it is wasted on
+	if (terrainField)
 	{
-		if (this == &pBoidList[i])
+		unsigned count = batch.end - batch.begin;
+		batch.terrainProbes.Resize(count);
+		batch.terrainSamples.Resize(count);
+		for (unsigned i = 0; i < count; i++)
+		{
+			batch.terrainProbes[i] = previous.position[batch.begin + i] +
+				previous.velocity[batch.begin + i] * parameters.terrainLookahead;
+		}
+		terrainField->Sample(&batch.terrainProbes[0], count, &batch.terrainSamples[0]);
+	}
+
+	// Each boid gathers from contiguous runs of the sorted arrays, so the kernel can test several neighbours at once
+	for (unsigned i = batch.begin; i < batch.end; i++)
+	{
+		const Vector3& position = previous.position[i];
+		const Vector3& velocity = previous.velocity[i];
+		next.position[i] = position;
+		next.velocity[i] = velocity;
+
+		// Reduced fish are staggered by index so each step refreshes an even share of them
+		unsigned char tier = lodTiers[i];
+		Vector3 terrainForce = terrainField ?
+			TerrainForce(batch.terrainProbes[i - batch.begin], batch.terrainSamples[i - batch.begin]) : Vector3::ZERO;
+		if (tier == BOID_LOD_DRIFT)
+		{
+			// Drifting fish skip their neighbours but still must not swim into the ground
+			next.force[i] = terrainForce;
+			Boid::Integrate(next.position[i], next.velocity[i], next.force[i], stepTime, parameters);
 			continue;
+		}
+		if (tier == BOID_LOD_REDUCED && (stepCount + i) % reducedInterval)
+		{
+			next.force[i] = previous.force[i];
+			Boid::Integrate(next.position[i], next.velocity[i], next.force[i], stepTime, parameters);
+			continue;
+		}
 
-		Vector3 position = pRigidBody->GetPosition();
-		Vector3 currBoidPos = pBoidList[i].pRigidBody->GetPosition();
+		SteeringSums sums;
+		sums.centerOfMass = Vector3::ZERO;
+		sums.heading = Vector3::ZERO;
+		sums.repel = Vector3::ZERO;
+		sums.numNeighbours = 0;
 
-		Vector3 separation = position - currBoidPos;
-		float deltaSeparation = separation.Length();
+		// Other species only push away; they never join the school's centre or heading
+		if (!batch.avoidStart.Empty())
+		{
+			unsigned first = batch.avoidStart[i - batch.begin];
+			unsigned last = batch.avoidStart[i - batch.begin + 1];
+			if (first != last)
+			{
+				SteeringSums avoid;
+				avoid.centerOfMass = Vector3::ZERO;
+				avoid.heading = Vector3::ZERO;
+				avoid.repel = Vector3::ZERO;
+				avoid.numNeighbours = 0;
+				kernel(*stepIndexState, &batch.avoidRanges[first], last - first, position, avoidRadii, avoid);
+				sums.repel += avoid.repel;
+			}
+		}
 
-		if (deltaSeparation < Range_FAttract)
+		if (neighbourMode == BOID_NEIGHBOURS_TOPOLOGICAL)
+			GatherNearest(batch, i, sums);
+		else
 		{
-			sum += pBoidList[i].pRigidBody->GetLinearVelocity();
-			n++;
+			// The kernel tests current positions against the exact radii; the cached runs only bound the candidates
+			unsigned first = batch.rangeStart[i - batch.begin];
+			unsigned last = batch.rangeStart[i - batch.begin + 1];
+			if (first != last)
+				kernel(*stepIndexState, &batch.ranges[first], last - first, position, radii, sums);
+
+			// The kernel counts the boid itself; it adds nothing to the separation sum
+			sums.centerOfMass -= position;
+			sums.heading -= velocity;
+			sums.numNeighbours--;
 		}
+
+		next.force[i] = Boid::ComputeForce(sums, position, velocity, parameters) + FleeForce(position) + terrainForce;
+		Boid::Integrate(next.position[i], next.velocity[i], next.force[i], stepTime, parameters);
 	}
+}
 
-	if (n > 0)
+void BoidSet::BuildNeighbourLists(FlockBatch& batch)
+{
+	const FlockState& previous = states[current];
+	float radius = parameters.GetNeighbourRange() + neighbourSkin;
+	float avoidRadius = parameters.repelRange + neighbourSkin;
+	unsigned count = batch.end - batch.begin;
+	// In topological mode the own neighbours come from the k-d tree; the index is only read for other species
+	bool ownRanges = neighbourMode == BOID_NEIGHBOURS_METRIC;
+
+	batch.ranges.Clear();
+	batch.rangeStart.Resize(ownRanges ? count + 1 : 0);
+	batch.avoidRanges.Clear();
+	batch.avoidStart.Resize(avoidIndexRanges.Empty() ? 0 : count + 1);
+	batch.candidates = 0;
+	batch.maxCandidates = 0;
+
+	for (unsigned i = 0; i < count; i++)
 	{
-		sum /= n;
-		sum.Normalize();
-		sum * FAlign_Factor;
+		const Vector3& position = previous.position[batch.begin + i];
 
-		force += sum - pRigidBody->GetLinearVelocity();
+		if (ownRanges)
+		{
+			// Only this flock's own points, which are all of them unless the index is shared with other flocks
+			unsigned first = batch.ranges.Size();
+			batch.rangeStart[i] = first;
+			stepIndex->QueryRanges(position, radius, batch.ranges, indexBegin, indexEnd);
+
+			unsigned candidates = 0;
+			for (unsigned j = first; j < batch.ranges.Size(); j++)
+				candidates += batch.ranges[j].end - batch.ranges[j].begin;
+			batch.candidates += candidates;
+			batch.maxCandidates = Max(batch.maxCandidates, candidates);
+		}
+
+		if (!avoidIndexRanges.Empty())
+		{
+			batch.avoidStart[i] = batch.avoidRanges.Size();
+			for (unsigned j = 0; j < avoidIndexRanges.Size(); j++)
+			{
+				stepIndex->QueryRanges(position, avoidRadius, batch.avoidRanges, avoidIndexRanges[j].begin,
+					avoidIndexRanges[j].end);
+			}
+		}
 	}
+	if (ownRanges)
+		batch.rangeStart[count] = batch.ranges.Size();
+	if (!avoidIndexRanges.Empty())
+		batch.avoidStart[count] = batch.avoidRanges.Size();
 }
 
-void Boid::ComputeAttraction(Boid *pBoidList)
+void BoidSet::GatherNearest(FlockBatch& batch, unsigned index, SteeringSums& sums) const
 {
-	Vector3 CenterOfMass;
-	int n = 0;
-	force = Vector3(0, 0, 0);
+	const FlockState& previous = states[current];
+	const Vector3& position = previous.position[index];
+	unsigned found = tree.QueryNearest(position, topologicalNeighbours, index, batch.nearest, batch.nearestDistance2);
 
-	for (int i = 0; i < 60; i++)
+	// All k neighbours attract and align; only those inside the repel radius push away
+	for (unsigned j = 0; j < found; j++)
 	{
-		if (this == &pBoidList[i])
-			continue;
+		unsigned neighbour = batch.nearest[j];
+		sums.centerOfMass += previous.position[neighbour];
+		sums.heading += previous.velocity[neighbour];
 
-		Vector3 position = pRigidBody->GetPosition();
-		Vector3 currBoidPos = pBoidList[i].pRigidBody->GetPosition();
+		float distance2 = batch.nearestDistance2[j];
+		if (distance2 < radii.repel2 && distance2 > 0.0f)
+			sums.repel += (position - previous.position[neighbour]) / sqrtf(distance2);
+	}
+	sums.numNeighbours = found;
+}
 
-		Vector3 separation = position - currBoidPos;
-		float deltaSeparation = separation.Length();
+Vector3 BoidSet::FleeForce(const Vector3& position) const
+{
+	Vector3 force(0, 0, 0);
+	float range = parameters.fleeRange;
+	if (range <= 0.0f)
+		return force;
 
-		if (deltaSeparation < Range_FAttract)
+	// Strongest right next to a player, fading linearly to nothing at the flee range
+	for (unsigned i = 0; i < players.Size(); i++)
+	{
+		Vector3 offset = position - players[i];
+		float distance2 = offset.LengthSquared();
+		if (distance2 < range * range && distance2 > 0.0f)
 		{
-			CenterOfMass += pBoidList[i].pRigidBody->GetPosition();
-			n++;
+			float distance = sqrtf(distance2);
+			force += offset * (parameters.fleeFactor * (1.0f - distance / range) / distance);
 		}
 	}
+	return force;
+}
+
+Vector3 BoidSet::TerrainForce(const Vector3& probe, const TerrainSample& sample) const
+{
+	float clearance = parameters.terrainClearance;
+	float distance = TerrainField::Distance(probe, sample);
+	if (clearance <= 0.0f || distance >= clearance)
+		return Vector3::ZERO;
+
+	// Along the surface normal, growing past terrainFactor once the probe is below ground
+	Vector3 normal = Vector3(-sample.slopeX, 1.0f, -sample.slopeZ).Normalized();
+	return normal * (parameters.terrainFactor * (1.0f - distance / clearance));
+}
+
+bool BoidSet::NeighbourListsExpired() const
+{
+	const FlockState& state = states[current];
+	float limit = neighbourSkin * 0.5f;
+	float limit2 = limit * limit;
 
-	if (n > 0)
+	// No pair can have closed in past the skin while every fish moved less than half of it
+	for (unsigned i = 0; i < state.Size(); i++)
 	{
-		CenterOfMass /= n;
-		Vector3 dir = (CenterOfMass - pRigidBody->GetPosition()).Normalized();
-		Vector3 vDesired = dir * FAttract_Vmax;
-		force += (vDesired - pRigidBody->GetLinearVelocity()) * FAttract_Factor;
+		if ((state.position[i] - listOrigins[i]).LengthSquared() > limit2)
+			return true;
 	}
+	return false;
 }
 
-void Boid::Update(float tm)
+void BoidSet::RunBatches()
 {
-	pRigidBody->ApplyForce(force);
-	Vector3 vel = pRigidBody->GetLinearVelocity();
-	float d = vel.Length();
-	if (d < 10.0f)
+	if (!workQueue || !workQueue->GetNumThreads() || batches.Size() < 2)
 	{
-		d = 10.0f;
-		pRigidBody->SetLinearVelocity(vel.Normalized()*d);
+		for (unsigned i = 0; i < batches.Size(); i++)
+			StepBatch(batches[i]);
+		return;
 	}
-	else if (d > 50.0f)
+
+	for (unsigned i = 0; i < batches.Size(); i++)
 	{
-		d = 50.0f;
-		pRigidBody->SetLinearVelocity(vel.Normalized()*d);
+		SharedPtr<WorkItem> item = workQueue->GetFreeItem();
+		item->priority_ = M_MAX_UNSIGNED;
+		item->workFunction_ = StepBatchWork;
+		item->aux_ = this;
+		item->start_ = &batches[i];
+		workQueue->AddWorkItem(item);
 	}
-	Vector3 vn = vel.Normalized();
-	Vector3 cp = -vn.CrossProduct(Vector3(0.0f, 1.0f, 0.0f));
-	float dp = cp.DotProduct(vn);
-	pRigidBody->SetRotation(Quaternion(Acos(dp), cp));
-	Vector3 p = pRigidBody->GetPosition();
-	if (p.y_ < 10.0f)
+	workQueue->Complete(M_MAX_UNSIGNED);
+}
+
+void BoidSet::UpdateLodTiers()
+{
+	const FlockState& state = states[current];
+	unsigned count = state.Size();
+	for (unsigned i = 0; i < MAX_BOID_LOD_TIERS; i++)
+		lodCounts[i] = 0;
+
+	// A deterministic flock has no camera tiers, since every copy sees its own view; players are the same everywhere
+	if (players.Empty() && (deterministic || !lodCamera))
 	{
-		p.y_ = 10.0f;
-		pRigidBody->SetPosition(p);
+		for (unsigned i = 0; i < count; i++)
+			lodTiers[i] = BOID_LOD_FULL;
+		lodCounts[BOID_LOD_FULL] = count;
+		return;
 	}
-	else if (p.y_ > 50.0f)
+
+	const Frustum* frustum = lodCamera && !deterministic ? &lodCamera->GetFrustum() : nullptr;
+	Vector3 cameraPosition = frustum ? lodCamera->GetNode()->GetWorldPosition() : Vector3::ZERO;
+	// The tiers are not sent with a setup or correction, so a deterministic flock's must not depend on earlier ones
+	float hysteresis = deterministic ? 0.0f : lodSettings.hysteresis;
+
+	for (unsigned i = 0; i < count; i++)
 	{
-		p.y_ = 50.0f;
-		pRigidBody->SetPosition(p);
+		const Vector3& position = state.position[i];
+		unsigned char tier = lodTiers[i];
+
+		// A fish keeps its tier until it is past the boundary by the hysteresis margin
+		float fullRange = lodSettings.fullDistance + (tier == BOID_LOD_FULL ? hysteresis : 0.0f);
+		float reducedRange = lodSettings.reducedDistance + (tier <= BOID_LOD_REDUCED ? hysteresis : 0.0f);
+
+		float playerDistance2 = M_INFINITY;
+		for (unsigned j = 0; j < players.Size(); j++)
+			playerDistance2 = Min(playerDistance2, (players[j] - position).LengthSquared());
+
+		unsigned char newTier = BOID_LOD_DRIFT;
+		if (playerDistance2 < fullRange * fullRange)
+			newTier = BOID_LOD_FULL;
+		else if (frustum)
+		{
+			float cameraDistance2 = (cameraPosition - position).LengthSquared();
+			Sphere bounds(position, tier != BOID_LOD_DRIFT ? hysteresis : 0.0f);
+			bool visible = frustum->IsInsideFast(bounds) != OUTSIDE;
+
+			if (visible && cameraDistance2 < fullRange * fullRange)
+				newTier = BOID_LOD_FULL;
+			else if (visible && cameraDistance2 < reducedRange * reducedRange)
+				newTier = BOID_LOD_REDUCED;
+			// Close behind the camera: keep steering so the school still looks right when the view turns
+			else if (cameraDistance2 < fullRange * fullRange)
+				newTier = BOID_LOD_REDUCED;
+		}
+
+		lodTiers[i] = newTier;
+		lodCounts[newTier]++;
 	}
 }
 
-void BoidSet::DrawDebugInfo()
+void BoidSet::MarkNeighbourListsBuilt()
+{
+	listOrigins = states[current].position;
+	neighbourListsDirty = false;
+	listStats.rebuilds++;
+}
+
+void BoidSet::SetStepIndex(const SpatialGrid* index, const SortedFlock* indexState, unsigned indexBegin, bool rebuild)
+{
+	stepIndex = index;
+	stepIndexState = indexState;
+	this->indexBegin = indexBegin;
+	indexEnd = indexBegin + states[current].Size();
+	rebuildNeighbourLists = rebuild;
+}
+
+void BoidSet::BeginStep()
 {
-	for (int i = 0; i < 60; i++)
+	UpdateLodTiers();
+
+	radii.attract2 = parameters.attractRange * parameters.attractRange;
+	radii.repel2 = parameters.repelRange * parameters.repelRange;
+	// Other species are only counted within the repel radius
+	avoidRadii.attract2 = radii.repel2;
+	avoidRadii.repel2 = radii.repel2;
+
+	// The nearest set changes whenever any fish passes another, so there is nothing to cache
+	if (neighbourMode == BOID_NEIGHBOURS_TOPOLOGICAL)
 	{
-		debug->AddLine(boidList[i].pRigidBody->GetPosition(), boidList[i].pRigidBody->GetRotation().EulerAngles().FORWARD, Color::BLUE, true);
+		const FlockState& previous = states[current];
+		HiresTimer timer;
+		tree.Build(&previous.position[0], previous.Size());
+		timings.gridUSec += timer.GetUSec(false);
 	}
 }
 
-void BoidSet::Initialise(ResourceCache *pRes, Scene *pScene, DebugRenderer* debug)
+void BoidSet::EndStep()
 {
-	this->debug = debug;
+	if (rebuildNeighbourLists && neighbourMode == BOID_NEIGHBOURS_METRIC)
+	{
+		unsigned long long candidates = 0;
+		listStats.maxSize = 0;
+		for (unsigned i = 0; i < batches.Size(); i++)
+		{
+			candidates += batches[i].candidates;
+			listStats.maxSize = Max(listStats.maxSize, batches[i].maxCandidates);
+		}
+		listStats.averageSize = (float)((double)candidates / states[current].Size());
+	}
+	listStats.steps++;
 
-	Initialized = true;
+	current ^= 1;
+	stepCount++;
+	timings.steps++;
+}
+
+void BoidSet::Step()
+{
+	URHO3D_PROFILE(StepFlock);
+
+	BeginStep();
 
-	for (int i = 0; i < 60; i++)
+	const FlockState& previous = states[current];
+	HiresTimer timer;
+
+	// The batches only read this step's state and write into the other buffer. Between rebuilds the grid order is
+	// kept, so the cached runs still index the right fish in the refreshed sorted arrays
+	if (neighbourMode == BOID_NEIGHBOURS_TOPOLOGICAL)
+		SetStepIndex(nullptr, nullptr, 0, false);
+	else
 	{
-		boidList[i].Initialise(pRes, pScene);
+		bool rebuild = NeedsNeighbourListRebuild();
+		if (rebuild)
+		{
+			grid.Build(&previous.position[0], previous.Size());
+			MarkNeighbourListsBuilt();
+		}
+		timings.gridUSec += timer.GetUSec(true);
+		sorted.Build(&previous.position[0], &previous.velocity[0], grid.GetSortedIndices());
+		timings.sortUSec += timer.GetUSec(true);
+		SetStepIndex(&grid, &sorted, 0, rebuild);
 	}
+
+	RunBatches();
+	timings.steerUSec += timer.GetUSec(true);
+
+	EndStep();
 }
 
-void BoidSet::Update(float ms)
+void BoidSet::ApplyTransforms(float alpha)
 {
-	//// For each given boid in the scene
-	for (Boid boid : boidList)
+	URHO3D_PROFILE(ApplyFlockTransforms);
+
+	const FlockState& previous = states[current ^ 1];
+	const FlockState& latest = states[current];
+	HiresTimer timer;
+
+	// Every tier keeps moving, so every node is written; only the steering work differs between tiers
+	for (unsigned i = 0; i < active.Size(); i++)
 	{
-	//	// If the current boid is in the player view frustum
-	//	if (boid.pObject->IsInView())
-	//	{
-	//		// Freeze the boid in position
-	//		boid.pRigidBody->SetPosition(boid.pRigidBody->GetPosition());
-	//	}
-	//	else
-	//	{
-			// Continue the normal update procedure
-			boid.ComputeForce(&boidList[0]);
-			boid.Update(ms);
-		}
+		Vector3 position = previous.position[i].Lerp(latest.position[i], alpha);
+		Vector3 velocity = previous.velocity[i].Lerp(latest.velocity[i], alpha);
+		boidList[active[i]].SetTransform(position, Boid::HeadingRotation(velocity));
+	}
+
+	timings.transformUSec += timer.GetUSec(false);
+}
+
+float BoidSet::NextRandom(float range)
+{
+	// The same linear congruential generator as Urho3D's Rand(), with per-flock state
+	randomState = randomState * 214013 + 2531011;
+	return ((randomState >> 16) & 32767) * range / 32768.0f;
+}
+
+void BoidSet::Update(float timeStep)
+{
+	if (active.Empty())
+		return;
+
+	URHO3D_PROFILE(UpdateFlock);
+
+	accumulator += timeStep;
+
+	unsigned steps = 0;
+	while (accumulator >= stepTime && steps < maxStepsPerFrame)
+	{
+		Step();
+		accumulator -= stepTime;
+		steps++;
 	}
 
+	// Too far behind: drop the backlog rather than trying to catch up over the next frames
+	if (accumulator >= stepTime)
+		accumulator = fmodf(accumulator, stepTime);
+
+	ApplyTransforms(accumulator / stepTime);
+}
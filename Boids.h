@@ -10,6 +10,7 @@
 #include <Urho3D/Graphics/Material.h>
 #include <Urho3D/Graphics/Octree.h>
 #include <Urho3D/Graphics/Renderer.h>
+#include <Urho3D/Graphics/StaticModelGroup.h>
 #include <Urho3D/Graphics/Zone.h>
 #include <Urho3D/Input/Controls.h>
 #include <Urho3D/Input/Input.h>
@@ -20,6 +21,13 @@
 #include <Urho3D/Resource/ResourceCache.h>
 #include <Urho3D/Scene/Scene.h>
 #include <Urho3D/Graphics/DebugRenderer.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Core/WorkQueue.h>
+
+#include "BoidKernels.h"
+#include "KdTree.h"
+#include "SpatialGrid.h"
+#include "TerrainField.h"
 
 namespace Urho3D
 {
@@ -32,53 +40,416 @@ namespace Urho3D
 
 using namespace Urho3D;
 
-class Boid
+/// Flock state in structure-of-arrays form, one entry per boid. BoidSet integrates it at a fixed rate and is
+/// its only owner; nodes are written from it after the steps of a frame.
+struct FlockState
+{
+	void Resize(unsigned size)
+	{
+		position.Resize(size);
+		velocity.Resize(size);
+		force.Resize(size);
+	}
+
+	void Reserve(unsigned size)
+	{
+		position.Reserve(size);
+		velocity.Reserve(size);
+		force.Reserve(size);
+	}
+
+	/// Move one entry over another, used to keep the active flock packed.
+	void Move(unsigned from, unsigned to)
+	{
+		position[to] = position[from];
+		velocity[to] = velocity[from];
+		force[to] = force[from];
+	}
+
+	unsigned Size() const { return position.Size(); }
+
+	PODVector<Vector3> position;
+	PODVector<Vector3> velocity;
+	PODVector<Vector3> force;
+};
+
+/// Time spent in each phase of the flock update in microseconds, accumulated until reset.
+struct FlockTimings
+{
+	void Reset()
+	{
+		steps = 0;
+		gridUSec = 0;
+		sortUSec = 0;
+		steerUSec = 0;
+		transformUSec = 0;
+	}
+
+	/// Fixed steps run.
+	unsigned steps = 0;
+	/// Building the neighbour grid, or the k-d tree in topological mode.
+	long long gridUSec = 0;
+	/// Copying the flock into grid order.
+	long long sortUSec = 0;
+	/// Neighbour queries, steering and integration over all batches.
+	long long steerUSec = 0;
+	/// Interpolating and writing node transforms.
+	long long transformUSec = 0;
+};
+
+/// How pooled fish take part in physics.
+enum BoidCollisionMode
+{
+	/// No rigid body at all; the flock never enters the physics step.
+	BOID_COLLISION_NONE = 0,
+	/// Kinematic sphere proxy, for when gameplay needs physics contacts with fish.
+	BOID_COLLISION_SPHERE,
+	/// Kinematic triangle mesh of the fish model. Most expensive.
+	BOID_COLLISION_MESH
+};
+
+/// Which fish a boid steers by.
+enum BoidNeighbourMode
+{
+	/// Every fish within the rule radii. Work per fish grows with the local density.
+	BOID_NEIGHBOURS_METRIC = 0,
+	/// The k nearest fish, wherever they are. Work per fish stays bounded however tightly the school packs.
+	BOID_NEIGHBOURS_TOPOLOGICAL
+};
+
+/// Largest k accepted for topological mode.
+static const unsigned MAX_TOPOLOGICAL_NEIGHBOURS = 32;
+
+/// Steering rules of one flock or species. Every BoidSet has its own copy.
+struct BoidParameters
+{
+	/// Largest radius any steering rule looks at. Used to size the neighbour grid.
+	float GetNeighbourRange() const { return Max(attractRange, repelRange); }
+
+	/// Radius for cohesion and alignment.
+	float attractRange = 30.0f;
+	/// Radius for separation, also used against other species the flock avoids.
+	float repelRange = 20.0f;
+	float attractFactor = 4.0f;
+	float repelFactor = 2.0f;
+	float alignFactor = 1.0f;
+	/// Speed of the desired velocity towards the local centre of mass.
+	float attractVmax = 5.0f;
+	float minSpeed = 10.0f;
+	float maxSpeed = 50.0f;
+	float minHeight = 10.0f;
+	float maxHeight = 50.0f;
+	/// Fish flee players closer than this. 0 disables fleeing. Keep it below BoidLodSettings::fullDistance so fleeing
+	/// fish are always fully steered.
+	float fleeRange = 0.0f;
+	/// Flee force at zero distance, fading to nothing at fleeRange.
+	float fleeFactor = 20.0f;
+	/// Fish closer than this to the terrain steer up and away from it. Needs a baked TerrainField.
+	float terrainClearance = 6.0f;
+	/// Terrain avoidance force at the surface, fading to nothing at terrainClearance.
+	float terrainFactor = 40.0f;
+	/// Seconds of travel ahead at which the terrain is probed, so fish turn before they reach a slope.
+	float terrainLookahead = 0.25f;
+};
+
+/// Simulation level of detail of a fish, from most to least expensive.
+enum BoidLodTier
 {
-	static float Range_FAttract;
-	static float Range_FRepel;
-	static float Range_FAlign;
-	static float FAttract_Factor;
-	static float FRepel_Factor;
-	static float FAlign_Factor;
-	static float FAttract_Vmax;
+	/// Full steering every step. Fish near the camera or a player.
+	BOID_LOD_FULL = 0,
+	/// Steering recomputed every few steps; the last force is reused in between.
+	BOID_LOD_REDUCED,
+	/// No neighbour query; the fish drifts along its velocity.
+	BOID_LOD_DRIFT,
+	MAX_BOID_LOD_TIERS
+};
+
+/// Distances choosing the simulation tier of each fish.
+struct BoidLodSettings
+{
+	/// Fish closer than this to a player, or visible and closer than this to the camera, get full steering.
+	float fullDistance = 40.0f;
+	/// Visible fish closer than this to the camera get reduced steering.
+	float reducedDistance = 120.0f;
+	/// Extra distance a fish must pass before dropping to a cheaper tier, so fish on a boundary do not flicker.
+	float hysteresis = 8.0f;
+	/// Steps between steering updates of reduced fish.
+	unsigned reducedInterval = 4;
+};
 
+/// Stable identifier of a pooled fish, valid from Spawn until Despawn.
+typedef unsigned BoidHandle;
+
+/// A slice of the flock stepped by one work item, with the cached neighbour lists of its fish.
+struct FlockBatch
+{
+	unsigned begin;
+	unsigned end;
+	/// Grid runs within the neighbour range plus skin of each fish at the last rebuild, concatenated.
+	PODVector<GridRange> ranges;
+	/// First entry in ranges of each fish in the batch, plus an end sentinel.
+	PODVector<unsigned> rangeStart;
+	/// Candidate neighbours in the batch's lists, total and largest per fish.
+	unsigned candidates = 0;
+	unsigned maxCandidates = 0;
+	/// Grid runs of other species' fish within the repel range plus skin, when the flock avoids other species.
+	PODVector<GridRange> avoidRanges;
+	PODVector<unsigned> avoidStart;
+	/// Terrain probe points of the batch's fish and the field sampled at them.
+	PODVector<Vector3> terrainProbes;
+	PODVector<TerrainSample> terrainSamples;
+	/// Nearest neighbour query results in topological mode.
+	unsigned nearest[MAX_TOPOLOGICAL_NEIGHBOURS];
+	float nearestDistance2[MAX_TOPOLOGICAL_NEIGHBOURS];
+};
+
+/// Neighbour list counters for tuning the skin. Steps and rebuilds accumulate until reset; the sizes describe the
+/// lists of the last rebuild.
+struct NeighbourListStats
+{
+	void Reset()
+	{
+		steps = 0;
+		rebuilds = 0;
+	}
+
+	unsigned steps = 0;
+	unsigned rebuilds = 0;
+	/// Average and largest number of candidate neighbours per fish.
+	float averageSize = 0.0f;
+	unsigned maxSize = 0;
+};
+
+class Boid
+{
 public:
 	Boid()
 	{
 		pNode = nullptr;
 		pRigidBody = nullptr;
 		pCollisionShape = nullptr;
-		pObject = nullptr;
+		pGroup = nullptr;
 	};
 
 	~Boid() {};
-	void Initialise(ResourceCache *pRes, Scene *pScene);
-	void ComputeForce(Boid* boid);
-	void Update(float ms);
+	/// Create the fish node and physics components. The fish starts disabled in the pool and is drawn as an
+	/// instance of the group once spawned.
+	void Initialise(Scene *pScene, Model* model, StaticModelGroup* group, BoidCollisionMode collisionMode);
+	/// Enable a pooled fish at a start position and velocity.
+	void Spawn(const Vector3& position, const Vector3& velocity);
+	/// Disable the fish, taking it out of rendering and physics.
+	void Despawn();
+	/// Move the fish node. A kinematic body, if any, follows the node.
+	void SetTransform(const Vector3& position, const Quaternion& rotation);
 
-	void ComputeAttraction(Boid *pBoidList);
-	void ComputeSeparation(Boid *pBoidList);
-	void ComputeAlignment(Boid *pBoidList);
+	/// Turn the neighbour sums into the cohesion, alignment and separation force.
+	static Vector3 ComputeForce(const SteeringSums& sums, const Vector3& position, const Vector3& velocity,
+		const BoidParameters& parameters);
+	/// Advance one fixed step with unit mass, then clamp speed and altitude.
+	static void Integrate(Vector3& position, Vector3& velocity, const Vector3& force, float timeStep,
+		const BoidParameters& parameters);
+	/// Orientation of a fish swimming along the velocity.
+	static Quaternion HeadingRotation(const Vector3& velocity);
 
 public:
-	Vector3 force;
 	Node* pNode;
 	RigidBody* pRigidBody;
 	CollisionShape* pCollisionShape;
-	StaticModel* pObject;
+	StaticModelGroup* pGroup;
 };
 
+class FlockManager;
+
 class BoidSet
 {
-public:
-	Boid boidList[60];
+	friend class FlockManager;
 
+public:
 	BoidSet();
 	BoidSet(DebugRenderer* debugRenderer) : debug(debugRenderer) {};
-	void Initialise(ResourceCache *pRes, Scene *pScene, DebugRenderer* debug);
-	void Update(float ms);
+	/// Create a pool of capacity fish up front, so spawning and despawning later never creates nodes or components.
+	void Initialise(ResourceCache *pRes, Scene *pScene, DebugRenderer* debug, unsigned capacity,
+		BoidCollisionMode collisionMode = BOID_COLLISION_NONE);
+	/// Activate up to count pooled fish at random places drawn from the flock's own generator. Returns the number
+	/// spawned and appends their handles if a vector is given.
+	unsigned Spawn(unsigned count, PODVector<BoidHandle>* handles = nullptr);
+	/// Return an active fish to the pool. Returns false if the handle is not active.
+	bool Despawn(BoidHandle handle);
+	/// Run as many fixed steps as the frame time covers, then place the nodes between the last two states. Not used
+	/// when a FlockManager steps the flock.
+	void Update(float timeStep);
+	/// Client side: show count fish with this state instead of simulating them, spawning or despawning to match. The
+	/// state becomes the latest of the two that ApplyTransforms interpolates between.
+	void SetReplicatedState(const Vector3* positions, const Vector3* velocities, unsigned count);
+	/// Overwrite both states of count active fish from flock state index first, for starting or correcting a
+	/// simulation that must match another one bit for bit.
+	void SetExactState(unsigned first, const Vector3* positions, const Vector3* velocities, unsigned count);
+	/// Set the state of the random generator that places spawned fish. Two flocks with the same state spawn
+	/// identically.
+	void SetRandomState(unsigned state) { randomState = state; }
+	unsigned GetRandomState() const { return randomState; }
+	/// Set whether the flock's evolution depends only on its state, parameters and player positions. The camera is
+	/// ignored: fish near a player get full steering and the rest drift, or every fish is fully steered without
+	/// players.
+	void SetDeterministic(bool enable) { deterministic = enable; }
+	bool IsDeterministic() const { return deterministic; }
 	void DrawDebugInfo();
+	/// Set the simulation rate in steps per second.
+	void SetStepRate(float stepsPerSecond);
+	/// Set the most steps one Update may run. Time beyond that is dropped so a slow frame cannot snowball.
+	void SetMaxStepsPerFrame(unsigned steps) { maxStepsPerFrame = Max(steps, 1u); }
+	float GetStepRate() const { return 1.0f / stepTime; }
+	unsigned GetMaxStepsPerFrame() const { return maxStepsPerFrame; }
+	BoidCollisionMode GetCollisionMode() const { return collisionMode; }
+	/// Set the steering rules. Takes effect at the next step.
+	void SetParameters(const BoidParameters& parameters);
+	const BoidParameters& GetParameters() const { return parameters; }
+	/// Select the steering kernel. Falls back to the scalar kernel if the type is unavailable on this CPU.
+	void SetKernel(SteeringKernelType type);
+	SteeringKernelType GetKernel() const { return kernelType; }
+	/// Return number of active fish.
+	unsigned GetNumBoids() const { return active.Size(); }
+	/// Return size of the pool.
+	unsigned GetCapacity() const { return boidList.Size(); }
+	/// Return the handle of the active fish at a flock state index.
+	BoidHandle GetHandle(unsigned index) const { return active[index]; }
+	Boid& GetBoid(BoidHandle handle) { return boidList[handle]; }
+	/// Return the flock state written by the last step. Entries follow the active order, see GetHandle.
+	const FlockState& GetState() const { return states[current]; }
+	/// Set the camera whose view decides the simulation tiers. Without a camera or players every fish gets full
+	/// steering. Ignored in deterministic mode.
+	void SetLodCamera(Camera* camera) { lodCamera = camera; }
+	/// Set the player positions. Fish near them keep full steering, and flee them if the parameters say so. Call each
+	/// frame as players move.
+	void SetPlayers(const PODVector<Vector3>& positions) { players = positions; }
+	/// Set the baked terrain the fish keep clear of, or null to only clamp altitude. Not owned.
+	void SetTerrainField(const TerrainField* field) { terrainField = field; }
+	void SetLodSettings(const BoidLodSettings& settings) { lodSettings = settings; }
+	const BoidLodSettings& GetLodSettings() const { return lodSettings; }
+	/// Return how many fish were in a tier at the last step.
+	unsigned GetNumBoidsInTier(BoidLodTier tier) const { return lodCounts[tier]; }
+	/// Choose between radius and k-nearest neighbourhoods. Can change at any time; takes effect at the next step.
+	void SetNeighbourMode(BoidNeighbourMode mode) { neighbourMode = mode; neighbourListsDirty = true; }
+	BoidNeighbourMode GetNeighbourMode() const { return neighbourMode; }
+	/// Set k for topological mode, clamped to 1..MAX_TOPOLOGICAL_NEIGHBOURS.
+	void SetTopologicalNeighbours(unsigned k) { topologicalNeighbours = Clamp(k, 1u, MAX_TOPOLOGICAL_NEIGHBOURS); }
+	unsigned GetTopologicalNeighbours() const { return topologicalNeighbours; }
+	/// Set the margin added to the neighbour range when caching neighbour lists. The lists are reused until some fish
+	/// has moved more than half of it; 0 rebuilds them every step.
+	void SetNeighbourSkin(float skin) { neighbourSkin = Max(skin, 0.0f); neighbourListsDirty = true; }
+	float GetNeighbourSkin() const { return neighbourSkin; }
+	const NeighbourListStats& GetNeighbourListStats() const { return listStats; }
+	void ResetNeighbourListStats() { listStats.Reset(); }
+	/// Return the phase timings accumulated since the last ResetTimings.
+	const FlockTimings& GetTimings() const { return timings; }
+	void ResetTimings() { timings.Reset(); }
+	/// Compute forces and integrate one step for a slice of the flock. Reads only the previous state and writes only
+	/// the slice's entries of the next one, so batches can run on any worker thread in any order.
+	void StepBatch(FlockBatch& batch);
 	bool Initialized = false;
 
 	DebugRenderer* debug;
+
+private:
+	/// Create the instanced render groups for a pool of capacity fish.
+	void CreateGroups(ResourceCache *pRes, Scene *pScene, unsigned capacity);
+	/// Split the active flock into work batches after its size changes.
+	void UpdateBatches();
+	/// Run all batches, on the work queue when there is more than one.
+	void RunBatches();
+	/// Return whether some fish moved more than half the skin since the neighbour lists were built.
+	bool NeighbourListsExpired() const;
+	/// Return whether this step has to rebuild the neighbour lists.
+	bool NeedsNeighbourListRebuild() const { return neighbourListsDirty || NeighbourListsExpired(); }
+	/// Record the positions the neighbour lists are about to be built from.
+	void MarkNeighbourListsBuilt();
+	/// Set the neighbour index this step's batches query. indexBegin is where this flock's fish start in it.
+	void SetStepIndex(const SpatialGrid* index, const SortedFlock* indexState, unsigned indexBegin, bool rebuild);
+	/// Steering away from players within the flee range.
+	Vector3 FleeForce(const Vector3& position) const;
+	/// Steering up and away from terrain sampled ahead of a fish.
+	Vector3 TerrainForce(const Vector3& probe, const TerrainSample& sample) const;
+	/// Rebuild the neighbour lists of a batch from the grid.
+	void BuildNeighbourLists(FlockBatch& batch);
+	/// Sum the steering inputs of one fish over its k nearest neighbours.
+	void GatherNearest(FlockBatch& batch, unsigned index, SteeringSums& sums) const;
+	/// Choose the simulation tier of every fish for the next step.
+	void UpdateLodTiers();
+	/// First phase of a step: choose tiers, set the radii and, in topological mode, rebuild the k-d tree.
+	void BeginStep();
+	/// Last phase of a step: swap the state buffers and update the counters.
+	void EndStep();
+	/// Advance the flock one fixed step on its own neighbour index.
+	void Step();
+	/// Write node transforms interpolated between the previous and the latest state.
+	void ApplyTransforms(float alpha);
+	/// Return a number in [0, range) from the flock's own generator.
+	float NextRandom(float range);
+
+	/// Fish pool, indexed by handle.
+	Vector<Boid> boidList;
+	/// Handles of active fish, packed in flock state order.
+	PODVector<BoidHandle> active;
+	/// Flock state index of each pooled fish, or M_MAX_UNSIGNED while it is in the pool.
+	PODVector<unsigned> activeIndex;
+	PODVector<BoidHandle> freeList;
+	BoidCollisionMode collisionMode = BOID_COLLISION_NONE;
+	/// Instanced renderers, each drawing a fixed range of pool handles.
+	PODVector<StaticModelGroup*> groups;
+
+	/// Double-buffered flock state: the last step's result is read while the next one is written, then they swap.
+	FlockState states[2];
+	unsigned current = 0;
+	float stepTime = 1.0f / 60.0f;
+	unsigned maxStepsPerFrame = 4;
+	/// Frame time not yet consumed by a fixed step.
+	float accumulator = 0.0f;
+	Vector<FlockBatch> batches;
+	WorkQueue* workQueue = nullptr;
+	BoidParameters parameters;
+	SteeringRadii radii;
+	/// Radii for the separation-only pass over other species.
+	SteeringRadii avoidRadii;
+	/// The flock's own grid, unused while a FlockManager steps it.
+	SpatialGrid grid;
+	/// Flock state in the grid order of the last neighbour list build, refreshed every step for the vector kernels.
+	SortedFlock sorted;
+	/// Index the batches read this step: the flock's own, or the manager's shared one.
+	const SpatialGrid* stepIndex = nullptr;
+	const SortedFlock* stepIndexState = nullptr;
+	/// Range of this flock's fish in the step index.
+	unsigned indexBegin = 0;
+	unsigned indexEnd = 0;
+	/// Ranges of other species' fish in the shared index that this flock steers away from. Set by FlockManager.
+	PODVector<GridRange> avoidIndexRanges;
+	BoidNeighbourMode neighbourMode = BOID_NEIGHBOURS_METRIC;
+	/// Neighbours per fish in topological mode. Seven matches what field studies of starling flocks report.
+	unsigned topologicalNeighbours = 7;
+	/// Rebuilt every step in topological mode.
+	KdTree tree;
+	float neighbourSkin = 6.0f;
+	/// Set when the flock changes size or the skin changes, so the next step rebuilds the lists.
+	bool neighbourListsDirty = true;
+	/// Whether the step in progress rebuilds the lists.
+	bool rebuildNeighbourLists = false;
+	/// Fish positions when the lists were built.
+	PODVector<Vector3> listOrigins;
+	NeighbourListStats listStats;
+	SteeringKernel kernel = nullptr;
+	SteeringKernelType kernelType = KERNEL_SCALAR;
+	FlockTimings timings;
+
+	/// Steps run so far, used to stagger reduced fish across steps.
+	unsigned stepCount = 0;
+	Camera* lodCamera = nullptr;
+	PODVector<Vector3> players;
+	const TerrainField* terrainField = nullptr;
+	BoidLodSettings lodSettings;
+	/// Simulation tier of each active fish, in flock state order.
+	PODVector<unsigned char> lodTiers;
+	unsigned lodCounts[MAX_BOID_LOD_TIERS] = {};
+	bool deterministic = false;
+	unsigned randomState = 1;
+	/// Manager recording this flock's spawns and despawns, if any.
+	FlockManager* manager = nullptr;
 };
\ No newline at end of file
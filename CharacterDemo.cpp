@@ -13,6 +13,7 @@
 #include <Urho3D/Input/Input.h>
 #include <Urho3D/IO/FileSystem.h>
 #include <Urho3D/Physics/CollisionShape.h>
+#include <Urho3D/Physics/PhysicsEvents.h>
 #include <Urho3D/Physics/PhysicsWorld.h>
 #include <Urho3D/Physics/RigidBody.h>
 #include <Urho3D/Resource/ResourceCache.h>
@@ -23,6 +24,7 @@
 #include <Urho3D/Network/Connection.h>
 #include <Urho3D/Network/Network.h>
 #include <Urho3D/Network/NetworkEvents.h>
+#include <Urho3D/Network/NetworkPriority.h>
 #include <Urho3D/IO/Log.h>
 #include <Urho3D/UI/LineEdit.h>
 #include <Urho3D/UI/Button.h>
@@ -31,9 +33,16 @@
 #include <Urho3D/UI/CheckBox.h>
 #include <Urho3D/Graphics/Terrain.h>
 #include <Urho3D/Graphics/Skybox.h>
+#include <Urho3D/Core/Profiler.h>
+#include <Urho3D/Core/WorkQueue.h>
 
 #include "Character.h"
 #include "CharacterDemo.h"
+#include "FlockReplicator.h"
+#include "FrameTraceRecorder.h"
+#include "InputReplicator.h"
+#include "SceneryScatter.h"
+#include "WaterReflection.h"
 #include "Touch.h"
 
 #include <Urho3D/DebugNew.h>
@@ -44,15 +53,57 @@ static DebugRenderer* debugRenderer;
 
 static const StringHash E_CLIENTOBJECTAUTHORITY("ClientObjectAuthority");
 static const StringHash PLAYER_ID("IDENTITY");
+/// Server tick rate, sent with E_CLIENTOBJECTAUTHORITY so the client samples its controls at the same rate.
+static const StringHash TICK_RATE("TickRate");
 static const StringHash E_CLIENTISREADY("ClientReadyToStart");
 static const StringHash E_ADDSCORE("AddScore");
+/// Fish a shark caught in one tick, sent with E_ADDSCORE.
+static const StringHash CAUGHT("Caught");
 
 static const unsigned short SERVER_PORT = 2345;
+/// Size of the fish pool, and how many of them swim at startup.
+static const unsigned BOID_CAPACITY = 60;
+static const unsigned NUM_BOIDS = 60;
+/// Default authoritative server tick rate, overridden by -tickrate. Physics, client inputs, the flocks and network
+/// updates all advance once per tick; fish nodes are interpolated between steps.
+static const int SERVER_TICK_RATE = 30;
+/// Most ticks one frame may run; a longer stall slows the simulation down instead of piling up work.
+static const int MAX_TICKS_PER_FRAME = 4;
+/// Spacing of the terrain samples the fish steer by, in world units.
+static const float TERRAIN_FIELD_CELL_SIZE = 2.0f;
+/// Distance within which a shark catches a fish.
+static const float SHARK_CAPTURE_RADIUS = 5.5f;
+/// Distance at which fish start fleeing a shark.
+static const float BOID_FLEE_RANGE = 25.0f;
+/// Distance from a client's camera within which it is sent every fish and shark update: where the fog ends.
+static const float INTEREST_RADIUS = 150.0f;
+/// Network updates between refreshes of a fish beyond the interest radius.
+static const unsigned FLOCK_DISTANT_UPDATE_INTERVAL = 8;
+/// Shark update priority lost per unit of distance from a client, and the floor it drops to. At the interest radius
+/// a shark is sent every fourth update.
+static const float SHARK_PRIORITY_DISTANCE_FACTOR = 0.5f;
+static const float SHARK_MIN_PRIORITY = 10.0f;
+/// World x and z rectangle the mushrooms are scattered over, and mushrooms per square unit in it: 1000 by default.
+static const Rect SCENERY_AREA(-1000.0f, -1000.0f, 500.0f, 500.0f);
+static const float SCENERY_DENSITY = 1000.0f / (1500.0f * 1500.0f);
+/// Side of a scenery chunk in terrain patches: 128 world units.
+static const unsigned SCENERY_CHUNK_PATCHES = 16;
+/// Random seed of the scenery scatter, so every peer places the same mushrooms.
+static const unsigned SCENERY_SEED = 1;
+/// Distance from the camera within which scenery chunks are created: the far clip plus half a chunk's diagonal, so
+/// every chunk reaching into view is there. Chunks are recycled past the retention radius.
+static const float SCENERY_LOAD_RADIUS = 400.0f;
+static const float SCENERY_RETAIN_RADIUS = 500.0f;
+/// Most scenery chunks placed per frame.
+static const unsigned SCENERY_CHUNKS_PER_FRAME = 4;
+/// Frame rate the water reflection lowers its quality to hold.
+static const float REFLECTION_TARGET_FPS = 60.0f;
 
 CharacterDemo::CharacterDemo(Context* context) :
     Sample(context),
     firstPerson_(false),
-	boidSet(debugRenderer)
+    dedicated_(false),
+    tickRate_(SERVER_TICK_RATE)
 {
 
 }
@@ -62,11 +113,57 @@ CharacterDemo::~CharacterDemo()
 
 }
 
+void CharacterDemo::Setup()
+{
+	Sample::Setup();
+
+	// -dedicated runs a server without a window, audio or renderer
+	dedicated_ = GetArguments().Contains("-dedicated");
+	if (dedicated_)
+		engineParameters_["Headless"] = true;
+}
+
 void CharacterDemo::Start()
 {
-    Sample::Start();
-    if (touchEnabled_)
-        touch_ = new Touch(context_, TOUCH_SENSITIVITY);
+	// There is no logo, console or touch input without a window
+	if (!dedicated_)
+	{
+		Sample::Start();
+		if (touchEnabled_)
+			touch_ = new Touch(context_, TOUCH_SENSITIVITY);
+	}
+
+	flockReplicator_ = new FlockReplicator(context_, &flocks);
+	// Clients step their own copy of the flocks and the server only corrects fish that drift, unless -flocksnapshots
+	// asks for the server to stream them
+	flockReplicator_->SetMode(GetArguments().Contains("-flocksnapshots") ? FLOCK_REPLICATION_SNAPSHOTS :
+		FLOCK_REPLICATION_DETERMINISTIC);
+	// Interest management only thins out streamed snapshots, so it takes effect with -flocksnapshots alone; a
+	// lockstep client simulates every fish whatever its distance
+	flockReplicator_->SetInterest(INTEREST_RADIUS, FLOCK_DISTANT_UPDATE_INTERVAL);
+	inputReplicator_ = new InputReplicator(context_);
+
+	// -tickrate <hz> [-scenerydensity <multiplier>]
+	scenery_.SetDensity(SCENERY_DENSITY);
+	const Vector<String>& arguments = GetArguments();
+	for (unsigned i = 0; i + 1 < arguments.Size(); ++i)
+	{
+		String argument = arguments[i].ToLower();
+		if (argument == "-tickrate")
+			tickRate_ = Max(ToInt(arguments[++i]), 1);
+		else if (argument == "-scenerydensity")
+			scenery_.SetDensity(SCENERY_DENSITY * ToFloat(arguments[++i]));
+	}
+
+	if (dedicated_)
+	{
+		SubscribeToEvents();
+		StartServer();
+		// Frames past the tick rate would find no tick to run
+		engine_->SetMaxFps(tickRate_);
+		StartFrameTrace();
+		return;
+	}
 
 	CreateMainMenu();
 	CreateClientScene();
@@ -75,6 +172,33 @@ void CharacterDemo::Start()
 
 	SubscribeToEvents();
 	Sample::InitMouseMode(MM_RELATIVE);
+
+	StartFrameTrace();
+}
+
+void CharacterDemo::StartFrameTrace()
+{
+	// -trace <file> [-tracefirst <frame>] [-traceframes <count>]
+	const Vector<String>& arguments = GetArguments();
+	String fileName;
+	unsigned firstFrame = 0;
+	unsigned numFrames = 300;
+	for (unsigned i = 0; i + 1 < arguments.Size(); ++i)
+	{
+		String argument = arguments[i].ToLower();
+		if (argument == "-trace")
+			fileName = arguments[++i];
+		else if (argument == "-tracefirst")
+			firstFrame = ToUInt(arguments[++i]);
+		else if (argument == "-traceframes")
+			numFrames = ToUInt(arguments[++i]);
+	}
+
+	if (fileName.Empty())
+		return;
+
+	traceRecorder_ = new FrameTraceRecorder(context_);
+	traceRecorder_->Start(fileName, firstFrame, numFrames);
 }
 
 Button* CharacterDemo::CreateButton(const String& text, int pHeight, Urho3D::Window* window)
@@ -155,45 +279,35 @@ void CharacterDemo::CreateScene()
 {
 	ResourceCache* cache = GetSubsystem<ResourceCache>();
 
+	// The fish of the previous scene go with it
+	flocks.RemoveAllFlocks();
+
 	scene_ = new Scene(context_);
 	scene_->CreateComponent<Octree>();
-	scene_->CreateComponent<PhysicsWorld>();
-	scene_->CreateComponent<DebugRenderer>();
-
-	debugRenderer = scene_->GetComponent<DebugRenderer>();
-
-	cameraNode_ = new Node(context_);
-	cameraNode_->SetPosition(Vector3(0.0f, 5.0f, 0.0f));
-
-	Camera* camera = cameraNode_->CreateComponent<Camera>();
-	camera->SetFarClip(300.0f);
+	// Each physics step is one server tick
+	PhysicsWorld* physicsWorld = scene_->CreateComponent<PhysicsWorld>();
+	physicsWorld->SetFps(tickRate_);
+	physicsWorld->SetMaxSubSteps(MAX_TICKS_PER_FRAME);
+
+	// A dedicated server has nothing to look through: no camera, lighting or debug drawing. Clients light their own
+	// scene.
+	Camera* camera = nullptr;
+	if (!dedicated_)
+	{
+		scene_->CreateComponent<DebugRenderer>();
 
-	GetSubsystem<Renderer>()->SetViewport(0, new Viewport(context_, scene_, camera));
+		cameraNode_ = new Node(context_);
+		cameraNode_->SetPosition(Vector3(0.0f, 5.0f, 0.0f));
 
-	Node* zoneNode = scene_->CreateChild("Zone");
-	Zone* zone = zoneNode->CreateComponent<Zone>();
-	zone->SetAmbientColor(Color(0.15f, 0.15f, 0.15f));
-	zone->SetFogColor(Color(0.5f, 0.5f, 0.7f));
-	zone->SetFogStart(10.0f);
-	zone->SetFogEnd(150.0f);
-	zone->SetBoundingBox(BoundingBox(-1000.0f, 1000.0f));
+		camera = cameraNode_->CreateComponent<Camera>();
+		camera->SetFarClip(300.0f);
 
-	Node* lightNode = scene_->CreateChild("DirectionalLight");
-	lightNode->SetDirection(Vector3(0.3f, -0.5f, 0.425f));
-	Light* light = lightNode->CreateComponent<Light>();
-	light->SetLightType(LIGHT_DIRECTIONAL);
-	light->SetCastShadows(true);
-	light->SetShadowBias(BiasParameters(0.00025f, 0.5f));
-	light->SetShadowCascade(CascadeParameters(10.0f, 50.0f, 200.0f, 0.0f,
-		0.8f));
-	light->SetSpecularIntensity(0.5f);
+		GetSubsystem<Renderer>()->SetViewport(0, new Viewport(context_, scene_, camera));
+	}
+	debugRenderer = scene_->GetComponent<DebugRenderer>();
 
-	Node* floorNode = scene_->CreateChild("Floor");
-	floorNode->SetPosition(Vector3(0.0f, -0.5f, 0.0f));
-	floorNode->SetScale(Vector3(23.0f, 23.0f, 23.0f));
-	StaticModel* object = floorNode->CreateComponent<StaticModel>();
-	object->SetModel(cache->GetResource<Model>("Models/Dome.mdl"));
-	object->SetMaterial(cache->GetResource<Material>("Materials/Water.xml"));
+	if (!dedicated_)
+		CreateLighting();
 
 	// TERRAIN
 	Node* terrainNode = scene_->CreateChild("Terrain");
@@ -215,11 +329,12 @@ void CharacterDemo::CreateScene()
 	CollisionShape* shapeTerrain = terrainNode->CreateComponent<CollisionShape>();
 	shapeTerrain->SetTerrain();
 
-	cameraNode_->SetPosition(Vector3(0.0f, terrain->GetHeight(cameraNode_->GetPosition()) + 2.25f, 0.0f));
+	if (cameraNode_)
+		cameraNode_->SetPosition(Vector3(0.0f, terrain->GetHeight(cameraNode_->GetPosition()) + 2.25f, 0.0f));
 
 	// WATER
 
-	Graphics* graphics = GetSubsystem<Graphics>();
+	// The water plane is replicated, so clients see it whether or not the server renders
 	waterNode_ = scene_->CreateChild("Water");
 	waterNode_->SetScale(Vector3(2048.0f, 1.0f, 2048.0f));
 	waterNode_->SetPosition(Vector3(0.0f, 60.55f, 0.0f));
@@ -236,54 +351,88 @@ void CharacterDemo::CreateScene()
 	waterClipPlane_ = Plane(waterNode_->GetWorldRotation() * Vector3(0.0f, 1.0f, 0.0f),
 		waterNode_->GetWorldPosition() - Vector3(0.0f, 0.01f, 0.0f));
 
-	reflectionCameraNode_ = cameraNode_->CreateChild();
-	Camera* reflectionCamera = reflectionCameraNode_->CreateComponent<Camera>();
-	reflectionCamera->SetFarClip(50.0);
-	reflectionCamera->SetViewMask(0x7fffffff); // Hide objects with only bit 31 in the viewmask (the water plane)
-	reflectionCamera->SetAutoAspectRatio(true);
-	reflectionCamera->SetUseReflection(true);
-	reflectionCamera->SetReflectionPlane(waterPlane_);
-	reflectionCamera->SetUseClipping(true); // Enable clipping of geometry behind water plane
-	reflectionCamera->SetClipPlane(waterClipPlane_);
-	// The water reflection texture is rectangular. Set reflection camera aspect ratio to match
-	reflectionCamera->SetAspectRatio((float)graphics->GetWidth() / (float)graphics->GetHeight());
-	// View override flags could be used to optimize reflection rendering. For example disable shadows
-	//reflectionCamera->SetViewOverrideFlags(VO_DISABLE_SHADOWS);
-	// Create a texture and setup viewport for water reflection. Assign the reflection texture to the diffuse
-	// texture unit of the water material
-	int texSize = 1024;
-	SharedPtr<Texture2D> renderTexture(new Texture2D(context_));
-	renderTexture->SetSize(texSize, texSize, Graphics::GetRGBFormat(), TEXTURE_RENDERTARGET);
-	renderTexture->SetFilterMode(FILTER_BILINEAR);
-	RenderSurface* surface = renderTexture->GetRenderSurface();
-	SharedPtr<Viewport> rttViewport(new Viewport(context_, scene_, reflectionCamera));
-	surface->SetViewport(0, rttViewport);
-	Material* waterMat = cache->GetResource<Material>("Materials/Water.xml");
-	waterMat->SetTexture(TU_DIFFUSE, renderTexture);
-
-	Node* skyNode = scene_->CreateChild("Sky");
+	if (!dedicated_)
+	{
+		CreateWaterReflection();
+		CreateScenery(terrain);
+	}
+
+	// Hits are found from the flock state, so the fish need no physics proxy
+	BoidParameters parameters;
+	parameters.fleeRange = BOID_FLEE_RANGE;
+	flocks.SetStepRate((float)tickRate_);
+	BoidSet* flock = flocks.CreateFlock(cache, scene_, debugRenderer, BOID_CAPACITY, parameters, BOID_COLLISION_NONE);
+	flock->Spawn(NUM_BOIDS);
+	flocks.SetLodCamera(camera);
+	// A few hundred kilobytes of samples stand in for per-fish raycasts against the terrain
+	terrainField.Bake(terrain, TERRAIN_FIELD_CELL_SIZE);
+	flocks.SetTerrainField(&terrainField);
+}
+
+void CharacterDemo::CreateWaterReflection()
+{
+	ResourceCache* cache = GetSubsystem<ResourceCache>();
+
+	// The reflection gives up resolution, update rate, shadows and distance when the frame runs over
+	waterReflection_ = new WaterReflection(context_);
+	waterReflection_->SetTargetFrameTime(1.0f / REFLECTION_TARGET_FPS);
+	waterReflection_->Create(scene_, cameraNode_, waterPlane_, waterClipPlane_,
+		cache->GetResource<Material>("Materials/Water.xml"));
+}
+
+void CharacterDemo::CreateScenery(Terrain* terrain)
+{
+	ResourceCache* cache = GetSubsystem<ResourceCache>();
+
+	sceneryNode_ = scene_->CreateChild("Scenery", LOCAL);
+
+	Node* skyNode = sceneryNode_->CreateChild("Sky", LOCAL);
 	skyNode->SetScale(500.0f); // The scale actually does not matter
 	Skybox* skybox = skyNode->CreateComponent<Skybox>();
 	skybox->SetModel(cache->GetResource<Model>("Models/Box.mdl"));
 	skybox->SetMaterial(cache->GetResource<Material>("Materials/Skybox.xml"));
 
-	unsigned NUM_OBJECTS = 1000;
-	for (unsigned i = 0; i < NUM_OBJECTS; ++i)
-	{
-		Node* objectNode = scene_->CreateChild("Box");
-		Vector3 position(Random(1500.0f) - 1000.0f, 0.0f, Random(1500.0f) - 1000.0f);
-		position.y_ = terrain->GetHeight(position);
-		objectNode->SetPosition(position);
-		// Create a rotation quaternion from up vector to terrain normal
-		objectNode->SetRotation(Quaternion(Vector3(0.0f, 1.0f, 0.0f), terrain->GetNormal(position)));
-		objectNode->SetScale(3.0f);
-		StaticModel* object = objectNode->CreateComponent<StaticModel>();
-		object->SetModel(cache->GetResource<Model>("Models/Mushroom.mdl"));
-		object->SetMaterial(cache->GetResource<Material>("Materials/Mushroom.xml"));
-		object->SetCastShadows(true);
-	}
+	// Mushrooms in instanced chunks, placed on worker threads as the camera nears them
+	scenery_.SetModel(cache->GetResource<Model>("Models/Mushroom.mdl"),
+		cache->GetResource<Material>("Materials/Mushroom.xml"), 3.0f);
+	scenery_.SetCastShadows(true);
+	scenery_.SetArea(SCENERY_AREA);
+	scenery_.SetChunkPatches(SCENERY_CHUNK_PATCHES);
+	scenery_.SetSeed(SCENERY_SEED);
+	// Only the chunks around the camera exist; Update brings in the rest as it moves
+	scenery_.SetStreaming(SCENERY_LOAD_RADIUS, SCENERY_RETAIN_RADIUS, SCENERY_CHUNKS_PER_FRAME);
+	scenery_.Create(sceneryNode_, terrain, GetSubsystem<WorkQueue>());
+}
+
 
-	boidSet.Initialise(cache, scene_, debugRenderer);
+void CharacterDemo::CreateLighting()
+{
+	ResourceCache* cache = GetSubsystem<ResourceCache>();
+
+	Node* zoneNode = scene_->CreateChild("Zone");
+	Zone* zone = zoneNode->CreateComponent<Zone>();
+	zone->SetAmbientColor(Color(0.15f, 0.15f, 0.15f));
+	zone->SetFogColor(Color(0.5f, 0.5f, 0.7f));
+	zone->SetFogStart(10.0f);
+	zone->SetFogEnd(150.0f);
+	zone->SetBoundingBox(BoundingBox(-1000.0f, 1000.0f));
+
+	Node* lightNode = scene_->CreateChild("DirectionalLight");
+	lightNode->SetDirection(Vector3(0.3f, -0.5f, 0.425f));
+	Light* light = lightNode->CreateComponent<Light>();
+	light->SetLightType(LIGHT_DIRECTIONAL);
+	light->SetCastShadows(true);
+	light->SetShadowBias(BiasParameters(0.00025f, 0.5f));
+	light->SetShadowCascade(CascadeParameters(10.0f, 50.0f, 200.0f, 0.0f,
+		0.8f));
+	light->SetSpecularIntensity(0.5f);
+
+	Node* floorNode = scene_->CreateChild("Floor");
+	floorNode->SetPosition(Vector3(0.0f, -0.5f, 0.0f));
+	floorNode->SetScale(Vector3(23.0f, 23.0f, 23.0f));
+	StaticModel* object = floorNode->CreateComponent<StaticModel>();
+	object->SetModel(cache->GetResource<Model>("Models/Dome.mdl"));
+	object->SetMaterial(cache->GetResource<Material>("Materials/Water.xml"));
 }
 
 void CharacterDemo::CreateClientScene()
@@ -326,6 +475,12 @@ void CharacterDemo::CreateClientScene()
 	StaticModel* object = floorNode->CreateComponent<StaticModel>();
 	object->SetModel(cache->GetResource<Model>("Models/Dome.mdl"));
 	object->SetMaterial(cache->GetResource<Material>("Materials/Water.xml"));
+
+	// An empty pool of LOCAL fish; the server's flock setup or snapshots spawn and move them
+	flocks.RemoveAllFlocks();
+	// Snapshots arrive at the server's tick rate, which is only known once the server sends it
+	flocks.SetStepRate((float)SERVER_TICK_RATE);
+	flocks.CreateFlock(cache, scene_, nullptr, BOID_CAPACITY);
 }
 
 // CLIENT
@@ -358,12 +513,20 @@ void CharacterDemo::HandleStartServer(StringHash eventType, VariantMap& eventDat
 {
 	Log::WriteRaw("HandleStartServer called");
 
+	StartServer();
+
+	menuVisible = !menuVisible;
+}
+
+// SERVER
+void CharacterDemo::StartServer()
+{
 	CreateScene();
 
 	Network* network = GetSubsystem<Network>();
+	// Replicate once per tick rather than at the default rate
+	network->SetUpdateFps(tickRate_);
 	network->StartServer(SERVER_PORT);
-
-	menuVisible = !menuVisible;
 }
 
 // CLIENT + SERVER
@@ -408,47 +571,106 @@ void CharacterDemo::HandleClientToServerReadyToStart(StringHash eventType, Varia
 	Connection* newConnection = static_cast<Connection*>(eventData[P_CONNECTION].GetPtr());
 
 	Node* newObject = CreateControllableObject();
+	// The owner always gets its own shark's updates, whatever their priority
+	newObject->SetOwner(newConnection);
 	serverObjects_[newConnection] = newObject;
 
 	VariantMap remoteEventData;
 	remoteEventData[PLAYER_ID] = newObject->GetID();
+	remoteEventData[TICK_RATE] = tickRate_;
 	newConnection->SendRemoteEvent(E_CLIENTOBJECTAUTHORITY, true, remoteEventData);
 }
 
 void CharacterDemo::CheckCollisions()
 {
+	URHO3D_PROFILE(CheckCollisions);
+
 	Network* network = GetSubsystem<Network>();
 	const Vector<SharedPtr<Connection> >& connections = network->GetClientConnections();
-	//Server: go through every client connected
+
+	//Server: gather the shark of every client connected, then find all hits in one pass over the flock index
+	captureHunters_.Clear();
+	captureSharks_.Clear();
+	captureCenters_.Clear();
 	for (unsigned i = 0; i < connections.Size(); ++i)
 	{
 		Connection* connection = connections[i];
 		// Get the object this connection is controlling
 		Node* ballNode = serverObjects_[connection];
+		RigidBody* body = ballNode ? ballNode->GetComponent<RigidBody>() : nullptr;
+		if (!body)
+			continue;
+		captureHunters_.Push(connection);
+		captureSharks_.Push(ballNode);
+		captureCenters_.Push(body->GetPosition());
+	}
+	if (captureCenters_.Empty())
+		return;
 
-		for (Boid boid : boidSet.boidList)
-		{
-			if ((ballNode->GetComponent<RigidBody>()->GetPosition() - boid.pRigidBody->GetPosition()).LengthSquared() < 30)
-			{
-				Log::WriteRaw("ADDING SCORE");
-				VariantMap remoteEventData;
-				remoteEventData[PLAYER_ID] = ballNode->GetID();
-				connection->SendRemoteEvent(E_ADDSCORE, true, remoteEventData);
-			}
-		}
+	flocks.QueryHits(captureCenters_, SHARK_CAPTURE_RADIUS, captureHits_);
+	if (captureHits_.Empty())
+		return;
+
+	// Handles first: each despawn moves the last fish of its flock into the hole, changing state indices
+	captureHandles_.Clear();
+	for (unsigned i = 0; i < captureHits_.Size(); ++i)
+		captureHandles_.Push(flocks.GetFlock(captureHits_[i].flock)->GetHandle(captureHits_[i].index));
+
+	// A caught fish leaves the flock, which lockstep clients repeat from the despawn event. A fish within reach of
+	// two sharks goes to the first
+	captureCounts_.Resize(captureSharks_.Size());
+	for (unsigned i = 0; i < captureCounts_.Size(); ++i)
+		captureCounts_[i] = 0;
+	for (unsigned i = 0; i < captureHits_.Size(); ++i)
+	{
+		if (flocks.GetFlock(captureHits_[i].flock)->Despawn(captureHandles_[i]))
+			captureCounts_[captureHits_[i].query]++;
+	}
+
+	// Replacements appear at random places, only now so none reuses the handle of a fish still to be despawned
+	for (unsigned i = 0; i < flocks.GetNumFlocks(); ++i)
+	{
+		BoidSet* flock = flocks.GetFlock(i);
+		if (flock->GetNumBoids() < NUM_BOIDS)
+			flock->Spawn(NUM_BOIDS - flock->GetNumBoids());
+	}
+
+	for (unsigned i = 0; i < captureCounts_.Size(); ++i)
+	{
+		if (!captureCounts_[i])
+			continue;
+		VariantMap remoteEventData;
+		remoteEventData[PLAYER_ID] = captureSharks_[i]->GetID();
+		remoteEventData[CAUGHT] = captureCounts_[i];
+		captureHunters_[i]->SendRemoteEvent(E_ADDSCORE, true, remoteEventData);
+	}
+}
+
+void CharacterDemo::UpdateFlockPlayers()
+{
+	// Fish near a shark flee it, and keep full steering even when the camera is looking elsewhere
+	PODVector<Vector3> players;
+	for (HashMap<Connection*, WeakPtr<Node> >::ConstIterator i = serverObjects_.Begin(); i != serverObjects_.End(); ++i)
+	{
+		if (i->second_)
+			players.Push(i->second_->GetWorldPosition());
 	}
+	// A client simulating the flocks is sent these positions, in this order, for each step
+	flocks.SetPlayers(players);
 }
 
 void CharacterDemo::AddScore(StringHash eventType, VariantMap& eventData)
 {
-	Score += 1;
-	instructionText->SetText("SCORE: 1");
+	Score += eventData[CAUGHT].GetInt();
+	instructionText->SetText("SCORE: " + String(Score));
 }
 
 //SERVER
 void CharacterDemo::HandleServerToClientObjectID(StringHash eventType, VariantMap & eventData)
 {
 	clientObjectID_ = eventData[PLAYER_ID].GetUInt();
+	inputReplicator_->SetTickRate((float)eventData[TICK_RATE].GetInt());
+	flocks.SetStepRate((float)eventData[TICK_RATE].GetInt());
 	Log::WriteRaw("Client ID: " + clientObjectID_);
 }
 
@@ -473,6 +695,12 @@ Node* CharacterDemo::CreateControllableObject()
 	CollisionShape* shape = ballNode->CreateComponent<CollisionShape>();
 	shape->SetTriangleMesh(ballObject->GetModel(), 0);
 
+	// Sharks far from a client's camera are sent to it less often
+	NetworkPriority* priority = ballNode->CreateComponent<NetworkPriority>();
+	priority->SetDistanceFactor(SHARK_PRIORITY_DISTANCE_FACTOR);
+	priority->SetMinPriority(SHARK_MIN_PRIORITY);
+	priority->SetAlwaysUpdateOwner(true);
+
 	Log::WriteRaw("Created player object");
 	return ballNode;
 
@@ -503,8 +731,10 @@ void CharacterDemo::MoveCamera()
 	}
 }
 
-void CharacterDemo::ProcessClientControls()
+void CharacterDemo::ProcessClientControls(float timeStep)
 {
+	URHO3D_PROFILE(ProcessClientControls);
+
 	Network* network = GetSubsystem<Network>();
 	const Vector<SharedPtr<Connection> >& connections = network->GetClientConnections();
 	//Server: go through every client connected
@@ -516,16 +746,19 @@ void CharacterDemo::ProcessClientControls()
 		// Client has no item connected
 		if (!ballNode) continue;
 		RigidBody* body = ballNode->GetComponent<RigidBody>();
-		// Get the last controls sent by the client
-		const Controls& controls = connection->GetControls();
+		// Get the client's input for this tick
+		PlayerInput controls;
+		if (!inputReplicator_->GetInput(connection, controls))
+			continue;
 		// Torque is relative to the forward vector
-		Quaternion rotation(controls.pitch_, controls.yaw_, 0.0f);
+		Quaternion rotation(controls.pitch, controls.yaw, 0.0f);
 		const float FORCE = 15.0f;
-		Quaternion rot2(0.0f, controls.yaw_ - 90.0f, -controls.pitch_ -90.0f);
+		Quaternion rot2(0.0f, controls.yaw - 90.0f, -controls.pitch -90.0f);
 
 		body->SetRotation(rot2);
-		if (controls.buttons_ & CTRL_FORWARD)
-			body->ApplyForce(rotation * Vector3::FORWARD * FORCE);
+		// Forces would add up over the substeps of a frame, so thrust is applied as this tick's impulse
+		if (controls.buttons & CTRL_FORWARD)
+			body->ApplyImpulse(rotation * Vector3::FORWARD * FORCE * timeStep);
 
 		//if (controls.buttons_ & CTRL_BACK)
 		//	body->ApplyForce(rotation * Vector3::BACK * MOVE_TORQUE);
@@ -539,7 +772,13 @@ void CharacterDemo::ProcessClientControls()
 
 void CharacterDemo::SubscribeToEvents()
 {
-	SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(CharacterDemo, HandleUpdate));
+	// A dedicated server has no camera, menu or controls to update
+	if (!dedicated_)
+	{
+		SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(CharacterDemo, HandleUpdate));
+		SubscribeToEvent(E_POSTUPDATE, URHO3D_HANDLER(CharacterDemo, HandlePostUpdate));
+	}
+	SubscribeToEvent(E_PHYSICSPRESTEP, URHO3D_HANDLER(CharacterDemo, HandleServerTick));
 
 	SubscribeToEvent(E_CLIENTCONNECTED, URHO3D_HANDLER(CharacterDemo, HandleClientConnected));
 	SubscribeToEvent(E_CLIENTDISCONNECTED, URHO3D_HANDLER(CharacterDemo, HandleClientDisconnected));
@@ -579,27 +818,36 @@ void CharacterDemo::HandleUpdate(StringHash eventType, VariantMap& eventData)
 	Network* network = GetSubsystem<Network>();
 	Connection* serverConnection = network->GetServerConnection();
 
+	using namespace Update;
+	float timeStep = eventData[P_TIMESTEP].GetFloat();
+
 	FrameInfo frameInfo = GetSubsystem<Renderer>()->GetFrameInfo();
 	//instructionText->SetText("FPS: " + String(1.0 / frameInfo.timeStep_));
-	instructionText->SetText("SCORE: " + Score);
+	instructionText->SetText("SCORE: " + String(Score));
 
 	if (serverConnection)
 	{
 		serverConnection->SetPosition(cameraNode_->GetPosition()); // send camera position too
-		serverConnection->SetControls(FromClientToServerControls()); // send controls to server
-	}
+		inputReplicator_->SampleControls(timeStep, FromClientToServerControls()); // send controls to server
 
-	else if (network->IsServerRunning())
-	{
-		ProcessClientControls(); // take data from clients, process it
+		// The scenery is not replicated; scatter it once the server's terrain has arrived
+		Terrain* replicatedTerrain = sceneryNode_ ? nullptr : scene_->GetComponent<Terrain>(true);
+		if (replicatedTerrain && replicatedTerrain->GetNumVertices().x_ > 0)
+			CreateScenery(replicatedTerrain);
 	}
 
+	if (sceneryNode_)
+		scenery_.Update(cameraNode_->GetWorldPosition());
+
+	// Whatever the menu or UI focus, so a client simulating the flocks keeps up with the server
+	if (serverConnection && flockReplicator_->IsSimulating())
+		flocks.Update(timeStep);
+	else if (serverConnection)
+		flocks.UpdateReplicated(timeStep);
+
 	const float MOVE_SPEED = 20.0f;
 	const float MOUSE_SENSITIVITY = 0.1f;
 
-	using namespace Update;
-	float timeStep = eventData[P_TIMESTEP].GetFloat();
-
 	if (GetSubsystem<UI>()->GetFocusElement()) 
 		return;
 
@@ -622,13 +870,6 @@ void CharacterDemo::HandleUpdate(StringHash eventType, VariantMap& eventData)
 			cameraNode_->Translate(Vector3::LEFT * MOVE_SPEED * timeStep);
 		if (input->GetKeyDown(KEY_D))
 			cameraNode_->Translate(Vector3::RIGHT * MOVE_SPEED * timeStep);
-
-		if (boidSet.Initialized)
-		{
-			//CheckCollisions();
-			boidSet.Update(timeStep);
-		}
-
 	}
 
 	if (input->GetKeyPress(KEY_M))
@@ -638,7 +879,28 @@ void CharacterDemo::HandleUpdate(StringHash eventType, VariantMap& eventData)
 	window_->SetVisible(menuVisible);
 }
 
+// SERVER
+void CharacterDemo::HandleServerTick(StringHash eventType, VariantMap& eventData)
+{
+	if (!GetSubsystem<Network>()->IsServerRunning())
+		return;
+
+	using namespace PhysicsPreStep;
+	float timeStep = eventData[P_TIMESTEP].GetFloat();
+
+	ProcessClientControls(timeStep); // take data from clients, process it
+	UpdateFlockPlayers();
+	// The flocks step at the tick rate; HandlePostUpdate places the fish between ticks
+	flocks.StepFixed();
+	CheckCollisions();
+}
+
 void CharacterDemo::HandlePostUpdate(StringHash eventType, VariantMap& eventData)
 {
+	if (!GetSubsystem<Network>()->IsServerRunning())
+		return;
 
+	// After the scene update, so this frame's ticks have run
+	using namespace PostUpdate;
+	flocks.UpdateTransforms(eventData[P_TIMESTEP].GetFloat());
 }
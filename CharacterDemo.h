@@ -21,8 +21,9 @@
 //
 
 #pragma once
-#include "Boids.h"
+#include "FlockManager.h"
 #include "Sample.h"
+#include "SceneryScatter.h"
 
 namespace Urho3D
 {
@@ -33,7 +34,11 @@ class Scene;
 }
 
 class Character;
+class FlockReplicator;
+class FrameTraceRecorder;
+class InputReplicator;
 class Touch;
+class WaterReflection;
 
 /// Moving character example.
 /// This sample demonstrates:
@@ -53,6 +58,8 @@ public:
     /// Destruct.
     ~CharacterDemo();
 
+    /// Setup before engine initialization. Runs headless for a dedicated server.
+    virtual void Setup();
     /// Setup after engine initialization and before running the main loop.
     virtual void Start();
 
@@ -106,13 +113,21 @@ protected:
     }
 
 private:
-    /// Create static scene content.
+    /// Create static scene content. A dedicated server creates only what the simulation and clients need.
     void CreateScene();
+	/// Create the zone, light and floor of the server's scene.
+	void CreateLighting();
+	/// Create the water reflection and its quality controller.
+	void CreateWaterReflection();
+	/// Create the skybox and scatter the mushrooms over the terrain as LOCAL nodes, on every peer that renders.
+	void CreateScenery(Terrain* terrain);
 	void CreateClientScene();
 
 	void HandleConnect(StringHash eventType, VariantMap& eventData);
 	void HandleDisconnect(StringHash eventType, VariantMap& eventData);
 	void HandleStartServer(StringHash eventType, VariantMap& eventData);
+	/// Create the scene and start serving it.
+	void StartServer();
 	void HandleQuit(StringHash eventType, VariantMap& eventData);
     
 	/// A client connecting to the server.
@@ -126,6 +141,8 @@ private:
     void SubscribeToEvents();
     /// Handle application update. Set controls to character.
     void HandleUpdate(StringHash eventType, VariantMap& eventData);
+	/// Run one server tick: apply each client's input for it and step the flocks. Called before every physics step.
+	void HandleServerTick(StringHash eventType, VariantMap& eventData);
     /// Handle application post-update. Update camera position after character has moved.
     void HandlePostUpdate(StringHash eventType, VariantMap& eventData);
 
@@ -142,9 +159,18 @@ private:
 
 	SharedPtr<Window> window_;
 
+	/// Whether running as a headless dedicated server.
+	bool dedicated_;
 	Terrain* terrain;
-
-	SharedPtr<Node> reflectionCameraNode_;
+	/// Parent of the LOCAL presentation-only scenery.
+	WeakPtr<Node> sceneryNode_;
+	/// Mushrooms scattered over the terrain, streamed in around the camera.
+	SceneryScatter scenery_;
+	/// Terrain heights baked for the flocks' ground avoidance.
+	TerrainField terrainField;
+
+	/// Water reflection and its quality controller.
+	SharedPtr<WaterReflection> waterReflection_;
 	/// Water body scene node.
 	SharedPtr<Node> waterNode_;
 	/// Reflection plane representing the water surface.
@@ -154,7 +180,21 @@ private:
 
 	LineEdit* addressInput;
 
-	BoidSet boidSet;
+	FlockManager flocks;
+	/// Sends the flocks to clients on the server and applies them on the client.
+	SharedPtr<FlockReplicator> flockReplicator_;
+	/// Sends stamped controls from the client and buffers them per client on the server.
+	SharedPtr<InputReplicator> inputReplicator_;
+	/// Server ticks per second.
+	int tickRate_;
+	/// Sharks queried and fish caught by them in the last CheckCollisions, kept to reuse the buffers.
+	PODVector<Connection*> captureHunters_;
+	PODVector<Node*> captureSharks_;
+	PODVector<Vector3> captureCenters_;
+	PODVector<FlockHit> captureHits_;
+	PODVector<BoidHandle> captureHandles_;
+	/// Fish each queried shark caught.
+	PODVector<unsigned> captureCounts_;
 
 	Node* CreateControllableObject();
 	unsigned clientObjectID_ = 0;
@@ -163,12 +203,20 @@ private:
 	void HandleServerToClientObjectID(StringHash eventType, VariantMap& eventData);
 	void HandleClientToServerReadyToStart(StringHash eventType, VariantMap& eventData);
 	void HandleClientStartGame(StringHash eventType, VariantMap & eventData);
-	void ProcessClientControls();
+	/// Apply each client's input for one tick of timeStep seconds to its shark.
+	void ProcessClientControls(float timeStep);
 	Controls FromClientToServerControls();
 	void MoveCamera();
 	void CheckCollisions();
+	/// Pass the shark positions to the flocks, for their simulation LOD and so the fish flee them.
+	void UpdateFlockPlayers();
 	void AddScore(StringHash eventType, VariantMap& eventData);
 
+	/// Start a Chrome trace capture if requested on the command line.
+	void StartFrameTrace();
+	/// Frame trace capture, if one was requested.
+	SharedPtr<FrameTraceRecorder> traceRecorder_;
+
 	int Score = 1;
 
 	Text* instructionText;
@@ -0,0 +1,323 @@
+#include <Urho3D/Core/ProcessUtils.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Engine/Engine.h>
+#include <Urho3D/Graphics/Octree.h>
+#include <Urho3D/IO/File.h>
+#include <Urho3D/IO/FileSystem.h>
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/Physics/PhysicsWorld.h>
+#include <Urho3D/Resource/ResourceCache.h>
+#include <Urho3D/Scene/Scene.h>
+
+#include "FlockBenchmark.h"
+
+#ifdef _WIN32
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <Urho3D/DebugNew.h>
+
+URHO3D_DEFINE_APPLICATION_MAIN(FlockBenchmark)
+
+/// Rate the flock is stepped at. Every Update runs exactly one step.
+static const float BENCHMARK_STEP_RATE = 60.0f;
+/// Steps between the two snapshots the delta size is measured from, matching the default 30 Hz network update.
+static const unsigned SNAPSHOT_INTERVAL_STEPS = 2;
+
+/// Return the peak resident memory of the process so far in kilobytes, or 0 if unknown.
+static unsigned long long GetPeakMemoryKB()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize / 1024;
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+#ifdef __APPLE__
+	// Reported in bytes on macOS, kilobytes elsewhere
+	return (unsigned long long)usage.ru_maxrss / 1024;
+#else
+	return (unsigned long long)usage.ru_maxrss;
+#endif
+#endif
+}
+
+/// Return microseconds as nanoseconds per boid per step.
+static double PerBoidStep(long long usec, unsigned count, unsigned steps)
+{
+	return steps && count ? usec * 1000.0 / ((double)count * steps) : 0.0;
+}
+
+/// Return whether two snapshots hold the same fish.
+static bool IsSameSnapshot(const FlockSnapshot& snapshot, const FlockSnapshot& other)
+{
+	if (snapshot.counts.Size() != other.counts.Size() || snapshot.boids.Size() != other.boids.Size())
+		return false;
+	for (unsigned i = 0; i < snapshot.counts.Size(); i++)
+	{
+		if (snapshot.counts[i] != other.counts[i])
+			return false;
+	}
+	for (unsigned i = 0; i < snapshot.boids.Size(); i++)
+	{
+		const QuantizedBoid& boid = snapshot.boids[i];
+		const QuantizedBoid& otherBoid = other.boids[i];
+		if (boid.x != otherBoid.x || boid.y != otherBoid.y || boid.z != otherBoid.z ||
+			boid.headingU != otherBoid.headingU || boid.headingV != otherBoid.headingV || boid.speed != otherBoid.speed)
+			return false;
+	}
+	return true;
+}
+
+/// Encode a snapshot, in full or against a baseline, and return whether it decodes unchanged.
+static bool CheckRoundTrip(const FlockSnapshot& snapshot, const FlockSnapshot* baseline)
+{
+	VectorBuffer message;
+	FlockReplicator::Encode(snapshot, baseline, message);
+	message.Seek(0);
+	unsigned sequence;
+	unsigned baselineSequence;
+	FlockReplicator::ReadHeader(message, sequence, baselineSequence);
+	FlockSnapshot decoded;
+	return sequence == snapshot.sequence && FlockReplicator::Decode(message, baselineSequence ? baseline : nullptr,
+		decoded) && IsSameSnapshot(snapshot, decoded);
+}
+
+/// Check that snapshots survive encoding: a compact flock, and one spread over several kilometres whose full
+/// positions do not fit 16 bits from its box corner. Fish beyond the baseline's are sent in full.
+static bool CheckSnapshotEncoding()
+{
+	FlockSnapshot baseline;
+	baseline.sequence = 1;
+	baseline.counts.Push(3);
+	baseline.counts.Push(3);
+	const QuantizedBoid boids[] =
+	{
+		{ 100, 20, -300, 12, 200, 90 },
+		{ 640, 75, 410, 128, 128, 0 },
+		{ -900, 30, 15, 255, 0, 255 },
+		{ -40000, 10, 5000, 64, 64, 100 },
+		{ 60000, 2000, -90000, 1, 2, 3 },
+		{ 150000, -500, 120000, 200, 100, 50 }
+	};
+	for (unsigned i = 0; i < sizeof(boids) / sizeof(boids[0]); i++)
+		baseline.boids.Push(boids[i]);
+
+	FlockSnapshot snapshot = baseline;
+	snapshot.sequence = 2;
+	snapshot.counts[1]++;
+	for (unsigned i = 0; i < snapshot.boids.Size(); i++)
+		snapshot.boids[i].x += 7;
+	const QuantizedBoid spawned = { 250000, 40, -250000, 30, 40, 50 };
+	snapshot.boids.Push(spawned);
+
+	return CheckRoundTrip(baseline, nullptr) && CheckRoundTrip(snapshot, nullptr) &&
+		CheckRoundTrip(snapshot, &baseline);
+}
+
+FlockBenchmark::FlockBenchmark(Context* context) :
+	Application(context),
+	numFlocks(1),
+	steps(600),
+	warmupSteps(60),
+	skin(-1.0f),
+	topologicalNeighbours(0),
+	kernelType(GetBestSteeringKernelType())
+{
+	counts.Push(60);
+	counts.Push(1000);
+	counts.Push(10000);
+}
+
+void FlockBenchmark::Setup()
+{
+	// Same resource search as Sample::Setup, without a window, sound or log file
+	engineParameters_["Headless"] = true;
+	engineParameters_["Sound"] = false;
+	engineParameters_["LogName"] = String::EMPTY;
+	engineParameters_["LogLevel"] = LOG_WARNING;
+	if (!engineParameters_.Contains("ResourcePrefixPaths"))
+		engineParameters_["ResourcePrefixPaths"] = ";../share/Resources;../share/Urho3D/Resources";
+}
+
+void FlockBenchmark::Start()
+{
+	if (!ParseArguments())
+	{
+		ErrorExit("Usage: FlockBenchmark [-boids n[,n...]] [-flocks n] [-steps n] [-warmup n] "
+			"[-kernel scalar|sse2|avx2] [-skin s] [-topological k] [-output file] [-nothreads]");
+		return;
+	}
+
+	if (!CheckSnapshotEncoding())
+	{
+		ErrorExit("Flock snapshots do not survive encoding");
+		return;
+	}
+
+	SharedPtr<File> output;
+	if (!outputName.Empty())
+	{
+		output = new File(context_, outputName, FILE_WRITE);
+		if (!output->IsOpen())
+		{
+			ErrorExit("Could not open " + outputName);
+			return;
+		}
+	}
+
+	for (unsigned i = 0; i < counts.Size(); i++)
+	{
+		String line = Run(counts[i]);
+		PrintLine(line);
+		if (output)
+			output->WriteLine(line);
+	}
+
+	engine_->Exit();
+}
+
+bool FlockBenchmark::ParseArguments()
+{
+	const Vector<String>& arguments = GetArguments();
+	for (unsigned i = 0; i < arguments.Size(); i++)
+	{
+		String argument = arguments[i].ToLower();
+		bool hasValue = i + 1 < arguments.Size();
+
+		if (argument == "-boids" && hasValue)
+		{
+			Vector<String> values = arguments[++i].Split(',');
+			counts.Clear();
+			for (unsigned j = 0; j < values.Size(); j++)
+			{
+				unsigned count = ToUInt(values[j]);
+				if (!count)
+					return false;
+				counts.Push(count);
+			}
+		}
+		else if (argument == "-flocks" && hasValue)
+			numFlocks = Max(ToUInt(arguments[++i]), 1u);
+		else if (argument == "-steps" && hasValue)
+			steps = Max(ToUInt(arguments[++i]), 1u);
+		else if (argument == "-warmup" && hasValue)
+			warmupSteps = ToUInt(arguments[++i]);
+		else if (argument == "-kernel" && hasValue)
+		{
+			String name = arguments[++i].ToLower();
+			unsigned type = 0;
+			while (type < MAX_KERNEL_TYPES && name != String(GetSteeringKernelName((SteeringKernelType)type)).ToLower())
+				type++;
+			if (type == MAX_KERNEL_TYPES)
+				return false;
+			kernelType = (SteeringKernelType)type;
+		}
+		else if (argument == "-output" && hasValue)
+			outputName = arguments[++i];
+		else if (argument == "-skin" && hasValue)
+			skin = Max(ToFloat(arguments[++i]), 0.0f);
+		else if (argument == "-topological" && hasValue)
+			topologicalNeighbours = Max(ToUInt(arguments[++i]), 1u);
+		else if (argument == "-boids" || argument == "-flocks" || argument == "-steps" || argument == "-warmup" ||
+			argument == "-kernel" || argument == "-output" || argument == "-skin" || argument == "-topological")
+			return false;
+	}
+
+	return !counts.Empty();
+}
+
+String FlockBenchmark::Run(unsigned count)
+{
+	// Same seed for every run so each flock size starts from the same spawn pattern
+	SetRandomSeed(1);
+
+	SharedPtr<Scene> scene(new Scene(context_));
+	scene->CreateComponent<Octree>();
+	scene->CreateComponent<PhysicsWorld>();
+
+	String line;
+	{
+		FlockManager flocks;
+		flocks.SetStepRate(BENCHMARK_STEP_RATE);
+		flocks.SetMaxStepsPerFrame(1);
+		for (unsigned i = 0; i < numFlocks; i++)
+		{
+			// Remainder goes to the first flocks so the sizes differ by at most one
+			unsigned flockCount = count / numFlocks + (i < count % numFlocks ? 1 : 0);
+			BoidSet* flock = flocks.CreateFlock(GetSubsystem<ResourceCache>(), scene, nullptr, Max(flockCount, 1u));
+			flock->SetKernel(kernelType);
+			if (skin >= 0.0f)
+				flock->SetNeighbourSkin(skin);
+			if (topologicalNeighbours)
+			{
+				flock->SetNeighbourMode(BOID_NEIGHBOURS_TOPOLOGICAL);
+				flock->SetTopologicalNeighbours(topologicalNeighbours);
+			}
+			flock->Spawn(flockCount);
+		}
+		BoidSet* first = flocks.GetFlock(0);
+
+		float timeStep = 1.0f / flocks.GetStepRate();
+		for (unsigned i = 0; i < warmupSteps; i++)
+			flocks.Update(timeStep);
+		flocks.ResetTimings();
+		for (unsigned i = 0; i < numFlocks; i++)
+			flocks.GetFlock(i)->ResetNeighbourListStats();
+
+		HiresTimer timer;
+		for (unsigned i = 0; i < steps; i++)
+			flocks.Update(timeStep);
+		long long totalUSec = timer.GetUSec(false);
+
+		const FlockTimings& timings = flocks.GetTimings();
+		WorkQueue* workQueue = GetSubsystem<WorkQueue>();
+		const char* neighbours = first->GetNeighbourMode() == BOID_NEIGHBOURS_TOPOLOGICAL ? "topological" : "metric";
+		line.AppendWithFormat("{\"boids\":%u,\"flocks\":%u,\"steps\":%u,\"kernel\":\"%s\",\"neighbours\":\"%s\","
+			"\"threads\":%u,\"total_ms\":%.3f,\"ns_per_boid_step\":%.3f,", count, numFlocks, timings.steps,
+			GetSteeringKernelName(first->GetKernel()), neighbours,
+			workQueue ? workQueue->GetNumThreads() + 1 : 1, totalUSec / 1000.0,
+			PerBoidStep(totalUSec, count, timings.steps));
+		line.AppendWithFormat("\"phases_ns_per_boid_step\":{\"grid\":%.3f,\"sort\":%.3f,\"steer\":%.3f,"
+			"\"transform\":%.3f},", PerBoidStep(timings.gridUSec, count, timings.steps),
+			PerBoidStep(timings.sortUSec, count, timings.steps), PerBoidStep(timings.steerUSec, count, timings.steps),
+			PerBoidStep(timings.transformUSec, count, timings.steps));
+		// The flocks share one index, so they all rebuild on the same steps
+		double candidates = 0.0;
+		unsigned maxSize = 0;
+		for (unsigned i = 0; i < numFlocks; i++)
+		{
+			const NeighbourListStats& stats = flocks.GetFlock(i)->GetNeighbourListStats();
+			candidates += (double)stats.averageSize * flocks.GetFlock(i)->GetNumBoids();
+			maxSize = Max(maxSize, stats.maxSize);
+		}
+		line.AppendWithFormat("\"neighbour_lists\":{\"skin\":%.3f,\"rebuilds\":%u,\"average_size\":%.1f,"
+			"\"max_size\":%u},", first->GetNeighbourSkin(), first->GetNeighbourListStats().rebuilds,
+			candidates / count, maxSize);
+		// Process-wide high-water mark, so it only grows across runs; order runs from small to large flocks
+		line.AppendWithFormat("\"peak_memory_kb\":%llu,", GetPeakMemoryKB());
+
+		// Wire size of the flock state in full, and as sent to a client that acknowledged the previous update
+		FlockSnapshot baseline;
+		FlockSnapshot snapshot;
+		VectorBuffer message;
+		FlockReplicator::Capture(flocks, 1, baseline);
+		for (unsigned i = 0; i < SNAPSHOT_INTERVAL_STEPS; i++)
+			flocks.Update(timeStep);
+		FlockReplicator::Capture(flocks, 2, snapshot);
+		FlockReplicator::Encode(snapshot, nullptr, message);
+		unsigned fullSize = message.GetSize();
+		FlockReplicator::Encode(snapshot, &baseline, message);
+		line.AppendWithFormat("\"snapshot_bytes_per_boid\":{\"full\":%.2f,\"delta\":%.2f}}",
+			(float)fullSize / count, (float)message.GetSize() / count);
+	}
+
+	return line;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <Urho3D/Engine/Application.h>
+
+#include "FlockReplicator.h"
+
+/// Headless flock benchmark. Steps the fish of a FlockManager in an otherwise empty scene for each requested size and
+/// prints one JSON line per run. First checks that flock snapshots decode to what was encoded, and exits with an
+/// error if not.
+///
+/// Options:
+///     -boids <n[,n...]>   Fish per run over all flocks, in order (default 60,1000,10000)
+///     -flocks <n>         Split the fish evenly over n flocks sharing one index (default 1)
+///     -steps <n>          Measured fixed steps per run (default 600)
+///     -warmup <n>         Unmeasured steps before each run (default 60)
+///     -kernel <name>      scalar, sse2 or avx2 (default: widest supported)
+///     -skin <s>           Neighbour list skin; 0 rebuilds the lists every step (default: BoidSet's)
+///     -topological <k>    Steer by the k nearest fish instead of the rule radii
+///     -output <file>      Also write the JSON lines to a file
+///     -nothreads          Engine option; steps the flock on the main thread only
+class FlockBenchmark : public Application
+{
+	URHO3D_OBJECT(FlockBenchmark, Application);
+
+public:
+	/// Construct.
+	FlockBenchmark(Context* context);
+
+	/// Setup before engine initialization.
+	virtual void Setup();
+	/// Run all benchmarks, then exit.
+	virtual void Start();
+
+private:
+	/// Read the benchmark options from the command line. Returns false on a malformed option.
+	bool ParseArguments();
+	/// Step count fish and return the result line.
+	String Run(unsigned count);
+
+	PODVector<unsigned> counts;
+	unsigned numFlocks;
+	unsigned steps;
+	unsigned warmupSteps;
+	/// Neighbour list skin, or negative to keep BoidSet's default.
+	float skin;
+	/// Neighbours per fish in topological mode, or 0 for metric mode.
+	unsigned topologicalNeighbours;
+	SteeringKernelType kernelType;
+	String outputName;
+};
@@ -0,0 +1,472 @@
+#include <Urho3D/Core/Profiler.h>
+
+#include "FlockManager.h"
+
+static void StepFlockBatchWork(const WorkItem* item, unsigned threadIndex)
+{
+	BoidSet* boidSet = reinterpret_cast<BoidSet*>(item->aux_);
+	FlockBatch* batch = reinterpret_cast<FlockBatch*>(item->start_);
+	boidSet->StepBatch(*batch);
+}
+
+FlockManager::~FlockManager()
+{
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		delete flocks[i];
+}
+
+BoidSet* FlockManager::CreateFlock(ResourceCache* pRes, Scene* pScene, DebugRenderer* debug, unsigned capacity,
+	const BoidParameters& parameters, BoidCollisionMode collisionMode)
+{
+	BoidSet* flock = new BoidSet(debug);
+	flock->Initialise(pRes, pScene, debug, capacity, collisionMode);
+	flock->SetParameters(parameters);
+	flock->SetStepRate(GetStepRate());
+	flock->SetDeterministic(deterministic);
+	flock->manager = this;
+	flocks.Push(flock);
+	workQueue = pScene->GetSubsystem<WorkQueue>();
+	return flock;
+}
+
+unsigned FlockManager::GetNumBoids() const
+{
+	unsigned count = 0;
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		count += flocks[i]->GetNumBoids();
+	return count;
+}
+
+void FlockManager::SetAvoidance(BoidSet* flock, BoidSet* other, bool enable)
+{
+	if (flock == other)
+		return;
+
+	for (unsigned i = 0; i < avoidances.Size(); i++)
+	{
+		if (avoidances[i].flock == flock && avoidances[i].other == other)
+		{
+			if (!enable)
+			{
+				avoidances.Erase(i);
+				flock->neighbourListsDirty = true;
+			}
+			return;
+		}
+	}
+
+	if (enable)
+	{
+		Avoidance avoidance = { flock, other };
+		avoidances.Push(avoidance);
+		flock->neighbourListsDirty = true;
+	}
+}
+
+bool FlockManager::GetAvoidance(const BoidSet* flock, const BoidSet* other) const
+{
+	for (unsigned i = 0; i < avoidances.Size(); i++)
+	{
+		if (avoidances[i].flock == flock && avoidances[i].other == other)
+			return true;
+	}
+	return false;
+}
+
+unsigned FlockManager::GetFlockIndex(const BoidSet* flock) const
+{
+	for (unsigned i = 0; i < flocks.Size(); i++)
+	{
+		if (flocks[i] == flock)
+			return i;
+	}
+	return M_MAX_UNSIGNED;
+}
+
+void FlockManager::SetLodCamera(Camera* camera)
+{
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		flocks[i]->SetLodCamera(camera);
+}
+
+void FlockManager::SetPlayers(const PODVector<Vector3>& positions)
+{
+	// Players standing still cost nothing to send
+	if (recordEvents && positions != players)
+	{
+		FlockEvent event = { stepCount, 0, FLOCK_EVENT_PLAYERS, positions.Size() };
+		events.Push(event);
+		recordedPlayers.Push(positions);
+	}
+
+	players = positions;
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		flocks[i]->SetPlayers(positions);
+}
+
+void FlockManager::QueuePlayers(unsigned step, const PODVector<Vector3>& positions)
+{
+	QueuedPlayers queued;
+	queued.step = step;
+	queued.positions = positions;
+	queuedPlayers.Push(queued);
+}
+
+void FlockManager::SetTerrainField(const TerrainField* field)
+{
+	terrainField = field;
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		flocks[i]->SetTerrainField(field);
+}
+
+void FlockManager::SetStepRate(float stepsPerSecond)
+{
+	stepTime = 1.0f / Max(stepsPerSecond, 1.0f);
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		flocks[i]->SetStepRate(stepsPerSecond);
+}
+
+void FlockManager::SetDeterministic(bool enable)
+{
+	deterministic = enable;
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		flocks[i]->SetDeterministic(enable);
+}
+
+void FlockManager::InvalidateNeighbourLists()
+{
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		flocks[i]->neighbourListsDirty = true;
+	// A list rebuild reorders the shared index and with it the order neighbour sums are added in, so a bit-exact
+	// copy has to rebuild at the same step
+	if (recordEvents && !flocks.Empty())
+	{
+		FlockEvent event = { stepCount, 0, FLOCK_EVENT_REBUILD, 0 };
+		events.Push(event);
+	}
+}
+
+void FlockManager::RecordEvent(const BoidSet* flock, FlockEventType type, unsigned value)
+{
+	if (!recordEvents)
+		return;
+	FlockEvent event = { stepCount, GetFlockIndex(flock), (unsigned char)type, value };
+	events.Push(event);
+}
+
+void FlockManager::Step()
+{
+	URHO3D_PROFILE(StepFlocks);
+
+	// Queued players that have reached their step, late ones included
+	unsigned numQueued = 0;
+	while (numQueued < queuedPlayers.Size() && queuedPlayers[numQueued].step <= stepCount)
+		numQueued++;
+	if (numQueued)
+	{
+		SetPlayers(queuedPlayers[numQueued - 1].positions);
+		queuedPlayers.Erase(0, numQueued);
+	}
+
+	HiresTimer timer;
+	unsigned numFlocks = flocks.Size();
+	offsets.Resize(numFlocks + 1);
+	bool rebuild = false;
+	unsigned count = 0;
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		BoidSet* flock = flocks[i];
+		offsets[i] = count;
+		if (!flock->GetNumBoids())
+		{
+			// A flock emptied since the last build still has fish in the index, shifting every later flock's
+			rebuild = rebuild || flock->neighbourListsDirty;
+			continue;
+		}
+		flock->BeginStep();
+		// One flock past its skin moves the shared order, so every flock rebuilds its lists together
+		rebuild = rebuild || flock->NeedsNeighbourListRebuild();
+		count += flock->GetNumBoids();
+	}
+	offsets[numFlocks] = count;
+
+	positions.Resize(count);
+	velocities.Resize(count);
+	float cellSize = 0.0f;
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		const FlockState& state = flocks[i]->GetState();
+		for (unsigned j = 0; j < state.Size(); j++)
+		{
+			positions[offsets[i] + j] = state.position[j];
+			velocities[offsets[i] + j] = state.velocity[j];
+		}
+		cellSize = Max(cellSize, flocks[i]->parameters.GetNeighbourRange());
+	}
+
+	if (rebuild)
+	{
+		// Sized for the widest-ranging species; the others just visit fewer, fuller cells
+		grid.SetCellSize(cellSize);
+		grid.Build(&positions[0], count);
+		// Empty flocks too, or IsIndexValid would never trust the index again
+		for (unsigned i = 0; i < numFlocks; i++)
+		{
+			if (flocks[i]->GetNumBoids())
+				flocks[i]->MarkNeighbourListsBuilt();
+			else
+				flocks[i]->neighbourListsDirty = false;
+		}
+	}
+	timings.gridUSec += timer.GetUSec(true);
+	sorted.Build(&positions[0], &velocities[0], grid.GetSortedIndices());
+	timings.sortUSec += timer.GetUSec(true);
+
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		BoidSet* flock = flocks[i];
+		flock->SetStepIndex(&grid, &sorted, offsets[i], rebuild);
+		if (!rebuild)
+			continue;
+
+		flock->avoidIndexRanges.Clear();
+		for (unsigned j = 0; j < avoidances.Size(); j++)
+		{
+			if (avoidances[j].flock != flock)
+				continue;
+			unsigned other = 0;
+			while (other < numFlocks && flocks[other] != avoidances[j].other)
+				other++;
+			if (other < numFlocks && offsets[other] != offsets[other + 1])
+			{
+				GridRange range = { offsets[other], offsets[other + 1] };
+				flock->avoidIndexRanges.Push(range);
+			}
+		}
+	}
+
+	// Batches of every flock go on the queue together, so many small flocks still keep all threads busy
+	unsigned numBatches = 0;
+	for (unsigned i = 0; i < numFlocks; i++)
+		numBatches += flocks[i]->batches.Size();
+	bool threaded = workQueue && workQueue->GetNumThreads() && numBatches > 1;
+
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		BoidSet* flock = flocks[i];
+		for (unsigned j = 0; j < flock->batches.Size(); j++)
+		{
+			if (!threaded)
+			{
+				flock->StepBatch(flock->batches[j]);
+				continue;
+			}
+
+			SharedPtr<WorkItem> item = workQueue->GetFreeItem();
+			item->priority_ = M_MAX_UNSIGNED;
+			item->workFunction_ = StepFlockBatchWork;
+			item->aux_ = flock;
+			item->start_ = &flock->batches[j];
+			workQueue->AddWorkItem(item);
+		}
+	}
+	if (threaded)
+		workQueue->Complete(M_MAX_UNSIGNED);
+	timings.steerUSec += timer.GetUSec(true);
+
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		if (flocks[i]->GetNumBoids())
+			flocks[i]->EndStep();
+	}
+	stepCount++;
+	timings.steps++;
+}
+
+void FlockManager::Update(float timeStep)
+{
+	if (!GetNumBoids())
+		return;
+
+	URHO3D_PROFILE(UpdateFlocks);
+
+	accumulator += timeStep;
+
+	unsigned steps = 0;
+	while (accumulator >= stepTime && steps < maxStepsPerFrame && stepCount < stepLimit)
+	{
+		Step();
+		accumulator -= stepTime;
+		steps++;
+	}
+
+	// Too far behind, or held at the step limit: drop the backlog rather than trying to catch up over the next frames
+	if (accumulator >= stepTime)
+		accumulator = fmodf(accumulator, stepTime);
+
+	ApplyTransforms(accumulator / stepTime);
+}
+
+void FlockManager::StepFixed()
+{
+	if (!GetNumBoids())
+		return;
+
+	URHO3D_PROFILE(UpdateFlocks);
+
+	Step();
+	// UpdateTransforms adds the frame time after the frame's ticks have run, so the accumulator follows the time
+	// the tick's own clock has left over, dipping below zero in between
+	accumulator -= stepTime;
+}
+
+void FlockManager::UpdateTransforms(float timeStep)
+{
+	if (!GetNumBoids())
+		return;
+
+	accumulator += timeStep;
+	// The tick dropped a backlog it could not run
+	if (accumulator >= stepTime)
+		accumulator = fmodf(accumulator, stepTime);
+
+	ApplyTransforms(Max(accumulator / stepTime, 0.0f));
+}
+
+void FlockManager::ApplyTransforms(float alpha)
+{
+	HiresTimer timer;
+	for (unsigned i = 0; i < flocks.Size(); i++)
+	{
+		if (flocks[i]->GetNumBoids())
+			flocks[i]->ApplyTransforms(alpha);
+	}
+	timings.transformUSec += timer.GetUSec(false);
+}
+
+bool FlockManager::IsIndexValid() const
+{
+	if (offsets.Size() != flocks.Size() + 1)
+		return false;
+
+	// A dirty flock has spawned, despawned or changed rules since the index was built
+	for (unsigned i = 0; i < flocks.Size(); i++)
+	{
+		if (flocks[i]->neighbourListsDirty || offsets[i + 1] - offsets[i] != flocks[i]->GetNumBoids())
+			return false;
+	}
+	return true;
+}
+
+void FlockManager::QueryHits(const PODVector<Vector3>& centers, float radius, PODVector<FlockHit>& hits)
+{
+	hits.Clear();
+
+	if (!IsIndexValid())
+	{
+		// Only until the next step rebuilds the index after a spawn or despawn
+		for (unsigned i = 0; i < centers.Size(); i++)
+			QueryHitsLinear(i, centers[i], radius, hits);
+		return;
+	}
+
+	// The index holds the positions of its last build. Every fish was then within half its skin of them at the start
+	// of the last step and has moved at most one step since
+	float margin = 0.0f;
+	for (unsigned i = 0; i < flocks.Size(); i++)
+	{
+		const BoidSet* flock = flocks[i];
+		margin = Max(margin, flock->neighbourSkin * 0.5f + flock->parameters.maxSpeed * stepTime);
+	}
+	float radius2 = radius * radius;
+	const PODVector<unsigned>& sortedIndices = grid.GetSortedIndices();
+
+	for (unsigned i = 0; i < centers.Size(); i++)
+	{
+		const Vector3& center = centers[i];
+		queryRanges.Clear();
+		grid.QueryRanges(center, radius + margin, queryRanges);
+
+		for (unsigned j = 0; j < queryRanges.Size(); j++)
+		{
+			for (unsigned k = queryRanges[j].begin; k < queryRanges[j].end; k++)
+			{
+				unsigned index = sortedIndices[k];
+				unsigned flock = 0;
+				while (index >= offsets[flock + 1])
+					flock++;
+				index -= offsets[flock];
+
+				if ((flocks[flock]->GetState().position[index] - center).LengthSquared() < radius2)
+				{
+					FlockHit hit = { i, flock, index };
+					hits.Push(hit);
+				}
+			}
+		}
+	}
+}
+
+void FlockManager::QueryHitsLinear(unsigned query, const Vector3& center, float radius,
+	PODVector<FlockHit>& hits) const
+{
+	float radius2 = radius * radius;
+	for (unsigned i = 0; i < flocks.Size(); i++)
+	{
+		const FlockState& state = flocks[i]->GetState();
+		for (unsigned j = 0; j < state.Size(); j++)
+		{
+			if ((state.position[j] - center).LengthSquared() < radius2)
+			{
+				FlockHit hit = { query, i, j };
+				hits.Push(hit);
+			}
+		}
+	}
+}
+
+void FlockManager::SetReplicatedState(unsigned flock, const Vector3* positions, const Vector3* velocities,
+	unsigned count)
+{
+	flocks[flock]->SetReplicatedState(positions, velocities, count);
+	accumulator = 0.0f;
+}
+
+void FlockManager::UpdateReplicated(float timeStep)
+{
+	URHO3D_PROFILE(UpdateFlocks);
+
+	// One state interval behind the server, and held at the latest state when the next one is late
+	accumulator += timeStep;
+	float alpha = Min(accumulator / stepTime, 1.0f);
+	for (unsigned i = 0; i < flocks.Size(); i++)
+	{
+		if (flocks[i]->GetNumBoids())
+			flocks[i]->ApplyTransforms(alpha);
+	}
+}
+
+void FlockManager::RemoveAllFlocks()
+{
+	for (unsigned i = 0; i < flocks.Size(); i++)
+		delete flocks[i];
+	flocks.Clear();
+	avoidances.Clear();
+	offsets.Clear();
+	accumulator = 0.0f;
+	stepCount = 0;
+	stepLimit = M_MAX_UNSIGNED;
+	events.Clear();
+	recordedPlayers.Clear();
+	players.Clear();
+	queuedPlayers.Clear();
+}
+
+void FlockManager::DrawDebugInfo()
+{
+	for (unsigned i = 0; i < flocks.Size(); i++)
+	{
+		if (flocks[i]->debug)
+			flocks[i]->DrawDebugInfo();
+	}
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include "Boids.h"
+
+/// A fish found within the radius of one point of a FlockManager::QueryHits batch.
+struct FlockHit
+{
+	/// Index of the query point.
+	unsigned query;
+	unsigned flock;
+	/// Flock state index of the fish, valid until the flock next spawns or despawns.
+	unsigned index;
+};
+
+/// Changes to a flock that a copy of it, stepped in lockstep elsewhere, has to repeat at the same step.
+enum FlockEventType
+{
+	FLOCK_EVENT_SPAWN = 0,
+	FLOCK_EVENT_DESPAWN,
+	/// The neighbour lists of every flock were invalidated.
+	FLOCK_EVENT_REBUILD,
+	/// The player positions changed. Their positions follow in the manager's recorded players.
+	FLOCK_EVENT_PLAYERS
+};
+
+/// A recorded change to a flock.
+struct FlockEvent
+{
+	/// Manager step count when it happened; it applies before the next step.
+	unsigned step;
+	unsigned flock;
+	unsigned char type;
+	/// Number of fish spawned, flock state index of the fish despawned, or number of players.
+	unsigned value;
+};
+
+/// Steps several flocks, each with its own steering parameters, over one spatial index shared by all of them. The
+/// index is built once per step from every flock's fish instead of once per flock, and a flock can be told to steer
+/// clear of the fish of other flocks. The manager owns its flocks.
+class FlockManager
+{
+public:
+	FlockManager() {};
+	/// Destruct. Deletes all flocks.
+	~FlockManager();
+
+	/// Create a flock with a pool of capacity fish and return it. Fish are spawned through the flock.
+	BoidSet* CreateFlock(ResourceCache* pRes, Scene* pScene, DebugRenderer* debug, unsigned capacity,
+		const BoidParameters& parameters = BoidParameters(), BoidCollisionMode collisionMode = BOID_COLLISION_NONE);
+	unsigned GetNumFlocks() const { return flocks.Size(); }
+	BoidSet* GetFlock(unsigned index) const { return flocks[index]; }
+	/// Return the number of active fish over all flocks.
+	unsigned GetNumBoids() const;
+
+	/// Set whether fish of flock steer away from fish of other, within flock's repel range. One-way; call both ways
+	/// for mutual avoidance.
+	void SetAvoidance(BoidSet* flock, BoidSet* other, bool enable);
+	/// Set the camera deciding the simulation tiers of all flocks.
+	void SetLodCamera(Camera* camera);
+	/// Set the player positions for all flocks. Call each frame as players move. The flee forces sum over the players
+	/// in this order, so a deterministic copy has to be given the same positions in the same order.
+	void SetPlayers(const PODVector<Vector3>& positions);
+	const PODVector<Vector3>& GetPlayers() const { return players; }
+	/// Set the player positions from step count step on, for a copy repeating the recorded players of another. They
+	/// take effect just before that step, however many steps one Update runs. Queue in step order.
+	void QueuePlayers(unsigned step, const PODVector<Vector3>& positions);
+	void ClearQueuedPlayers() { queuedPlayers.Clear(); }
+	/// Set the baked terrain all flocks keep clear of. Not owned.
+	void SetTerrainField(const TerrainField* field);
+	const TerrainField* GetTerrainField() const { return terrainField; }
+	/// Set the simulation rate in steps per second, shared by all flocks.
+	void SetStepRate(float stepsPerSecond);
+	/// Set the most steps one Update may run.
+	void SetMaxStepsPerFrame(unsigned steps) { maxStepsPerFrame = Max(steps, 1u); }
+	float GetStepRate() const { return 1.0f / stepTime; }
+	/// Return whether fish of flock steer clear of fish of other.
+	bool GetAvoidance(const BoidSet* flock, const BoidSet* other) const;
+	/// Return the index of a flock, or M_MAX_UNSIGNED if the manager does not own it.
+	unsigned GetFlockIndex(const BoidSet* flock) const;
+
+	/// Set whether the flocks' evolution depends only on their state and the players, so a copy stepped elsewhere from
+	/// the same state with the same players stays identical. Applies to existing and future flocks.
+	void SetDeterministic(bool enable);
+	bool IsDeterministic() const { return deterministic; }
+	/// Return the number of shared steps run, the clock of a deterministic simulation.
+	unsigned GetStepCount() const { return stepCount; }
+	void SetStepCount(unsigned count) { stepCount = count; }
+	/// Set the step count Update stops at, for a copy that must not run ahead of the changes it is sent.
+	void SetStepLimit(unsigned count) { stepLimit = count; }
+	/// Make every flock rebuild its neighbour lists at the next step.
+	void InvalidateNeighbourLists();
+	/// Set whether spawns, despawns, list invalidations and player moves are recorded, for sending to copies of the
+	/// flocks.
+	void SetRecordEvents(bool enable) { recordEvents = enable; }
+	/// Record a change to a flock if recording. Called by the flocks.
+	void RecordEvent(const BoidSet* flock, FlockEventType type, unsigned value);
+	const PODVector<FlockEvent>& GetEvents() const { return events; }
+	/// Return the positions of the recorded player events, concatenated in event order.
+	const PODVector<Vector3>& GetRecordedPlayers() const { return recordedPlayers; }
+	void ClearEvents() { events.Clear(); recordedPlayers.Clear(); }
+
+	/// Run as many fixed steps as the frame time covers, then place the nodes of every flock.
+	void Update(float timeStep);
+	/// Run one fixed step now, for a caller whose own fixed tick runs at the step rate. The nodes are placed by
+	/// UpdateTransforms.
+	void StepFixed();
+	/// Place the nodes of every flock between the last two StepFixed steps, by the frame time elapsed since the last.
+	void UpdateTransforms(float timeStep);
+	/// Client side: show a received state for one flock. The step rate should be set to the rate states arrive at.
+	void SetReplicatedState(unsigned flock, const Vector3* positions, const Vector3* velocities, unsigned count);
+	/// Client side: place the nodes of every flock between the last two received states instead of stepping.
+	void UpdateReplicated(float timeStep);
+	/// Delete all flocks, for when their scene is about to go.
+	void RemoveAllFlocks();
+	void DrawDebugInfo();
+	/// Find the fish of every flock within radius of each center, in the latest state, and replace hits with them
+	/// ordered by query point. Reads the shared index, so only nearby fish are tested.
+	void QueryHits(const PODVector<Vector3>& centers, float radius, PODVector<FlockHit>& hits);
+
+	/// Return the phase timings of the shared steps accumulated since the last ResetTimings.
+	const FlockTimings& GetTimings() const { return timings; }
+	void ResetTimings() { timings.Reset(); }
+
+private:
+	/// One flock that steers clear of another.
+	struct Avoidance
+	{
+		BoidSet* flock;
+		BoidSet* other;
+	};
+
+	/// Player positions waiting for their step.
+	struct QueuedPlayers
+	{
+		unsigned step;
+		PODVector<Vector3> positions;
+	};
+
+	/// Advance every flock one fixed step on the shared index.
+	void Step();
+	/// Place the nodes of every flock at alpha between the previous and latest states.
+	void ApplyTransforms(float alpha);
+	/// Return whether the shared index still holds every active fish at its flock state index.
+	bool IsIndexValid() const;
+	/// Append the hits of one query point by testing every fish.
+	void QueryHitsLinear(unsigned query, const Vector3& center, float radius, PODVector<FlockHit>& hits) const;
+
+	PODVector<BoidSet*> flocks;
+	PODVector<Avoidance> avoidances;
+	/// Start of each flock's fish in the shared index, plus an end sentinel.
+	PODVector<unsigned> offsets;
+	/// Positions and velocities of all flocks, concatenated in flock order.
+	PODVector<Vector3> positions;
+	PODVector<Vector3> velocities;
+	SpatialGrid grid;
+	SortedFlock sorted;
+	/// Scratch runs for QueryHits.
+	PODVector<GridRange> queryRanges;
+	WorkQueue* workQueue = nullptr;
+	float stepTime = 1.0f / 60.0f;
+	unsigned maxStepsPerFrame = 4;
+	float accumulator = 0.0f;
+	FlockTimings timings;
+	const TerrainField* terrainField = nullptr;
+	bool deterministic = false;
+	unsigned stepCount = 0;
+	unsigned stepLimit = M_MAX_UNSIGNED;
+	bool recordEvents = false;
+	PODVector<FlockEvent> events;
+	PODVector<Vector3> recordedPlayers;
+	/// Player positions of the last SetPlayers, and queued ones in step order.
+	PODVector<Vector3> players;
+	Vector<QueuedPlayers> queuedPlayers;
+};
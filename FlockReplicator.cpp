@@ -0,0 +1,1297 @@
+#include <Urho3D/Core/CoreEvents.h>
+#include <Urho3D/Graphics/Terrain.h>
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/Network/Connection.h>
+#include <Urho3D/Network/Network.h>
+#include <Urho3D/Network/NetworkEvents.h>
+#include <Urho3D/Scene/Scene.h>
+
+#include "FlockReplicator.h"
+
+/// Snapshots kept for delta encoding. A client further behind than this gets a full snapshot.
+static const unsigned SNAPSHOT_HISTORY = 32;
+/// Position resolution. At this scale one network update of the fastest fish fits a one byte delta per axis.
+static const float POSITION_QUANTA_PER_UNIT = 32.0f;
+/// Flock boxes are snapped to this many quanta so full positions fit 16 bits from the box corner.
+static const int BOX_QUANTA = 512;
+/// Largest offset from the box corner a 16 bit full position holds, about 2048 world units. A flock spread wider
+/// sends its full positions as variable length offsets instead.
+static const int MAX_BOX_OFFSET = 65535;
+/// Speed sent as a byte over 0..MAX_WIRE_SPEED.
+static const float MAX_WIRE_SPEED = 64.0f;
+/// Smallest encodings of a fish and of a flock header, for rejecting truncated messages.
+static const unsigned MIN_BOID_BYTES = 6;
+static const unsigned MIN_FLOCK_BYTES = 8;
+
+/// Fish per checksum. A mismatch costs a correction of this many fish.
+static const unsigned CHECKSUM_BLOCK_SIZE = 64;
+/// Steps between checksums.
+static const unsigned CHECK_INTERVAL_STEPS = 15;
+/// Steps a client stays behind its estimate of the server's step, so events and corrections arrive before the
+/// client reaches the step they apply at.
+static const unsigned CLIENT_DELAY_STEPS = 6;
+/// Steps a client may fall behind before it asks for a new setup instead of catching up.
+static const unsigned MAX_CLIENT_LAG_STEPS = 120;
+/// Exact fish state on the wire: position and velocity.
+static const unsigned EXACT_BOID_BYTES = 24;
+/// Smallest encoding of an event.
+static const unsigned MIN_EVENT_BYTES = 7;
+/// Marks a queued correction among the client's pending events. Never recorded by FlockManager.
+static const unsigned char FLOCK_EVENT_CORRECTION = 255;
+
+/// Steering parameters in wire order.
+static float BoidParameters::* const PARAMETER_FIELDS[] =
+{
+	&BoidParameters::attractRange,
+	&BoidParameters::repelRange,
+	&BoidParameters::attractFactor,
+	&BoidParameters::repelFactor,
+	&BoidParameters::alignFactor,
+	&BoidParameters::attractVmax,
+	&BoidParameters::minSpeed,
+	&BoidParameters::maxSpeed,
+	&BoidParameters::minHeight,
+	&BoidParameters::maxHeight,
+	&BoidParameters::fleeRange,
+	&BoidParameters::fleeFactor,
+	&BoidParameters::terrainClearance,
+	&BoidParameters::terrainFactor,
+	&BoidParameters::terrainLookahead
+};
+static const unsigned NUM_PARAMETER_FIELDS = sizeof(PARAMETER_FIELDS) / sizeof(PARAMETER_FIELDS[0]);
+
+static unsigned ZigZag(int value)
+{
+	return ((unsigned)value << 1) ^ (unsigned)(value >> 31);
+}
+
+static int UnZigZag(unsigned value)
+{
+	return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+static int QuantizePosition(float value)
+{
+	return (int)floorf(value * POSITION_QUANTA_PER_UNIT + 0.5f);
+}
+
+static unsigned char QuantizeUnit(float value)
+{
+	return (unsigned char)Clamp((int)((value * 0.5f + 0.5f) * 255.0f + 0.5f), 0, 255);
+}
+
+/// Map a direction onto the octahedron and unfold it into a square, for two bytes of fairly uniform precision.
+static void EncodeHeading(const Vector3& velocity, unsigned char& u, unsigned char& v)
+{
+	float l1 = Abs(velocity.x_) + Abs(velocity.y_) + Abs(velocity.z_);
+	if (l1 < M_EPSILON)
+	{
+		u = v = 128;
+		return;
+	}
+
+	float a = velocity.x_ / l1;
+	float b = velocity.z_ / l1;
+	if (velocity.y_ < 0.0f)
+	{
+		float foldedA = (1.0f - Abs(b)) * (a >= 0.0f ? 1.0f : -1.0f);
+		float foldedB = (1.0f - Abs(a)) * (b >= 0.0f ? 1.0f : -1.0f);
+		a = foldedA;
+		b = foldedB;
+	}
+	u = QuantizeUnit(a);
+	v = QuantizeUnit(b);
+}
+
+static Vector3 DecodeHeading(unsigned char u, unsigned char v)
+{
+	float a = u / 255.0f * 2.0f - 1.0f;
+	float b = v / 255.0f * 2.0f - 1.0f;
+	float y = 1.0f - Abs(a) - Abs(b);
+	if (y < 0.0f)
+	{
+		float unfoldedA = (1.0f - Abs(b)) * (a >= 0.0f ? 1.0f : -1.0f);
+		float unfoldedB = (1.0f - Abs(a)) * (b >= 0.0f ? 1.0f : -1.0f);
+		a = unfoldedA;
+		b = unfoldedB;
+	}
+	return Vector3(a, y, b).Normalized();
+}
+
+static bool IsSameBoid(const QuantizedBoid& boid, const QuantizedBoid& other)
+{
+	return boid.x == other.x && boid.y == other.y && boid.z == other.z && boid.headingU == other.headingU &&
+		boid.headingV == other.headingV && boid.speed == other.speed;
+}
+
+/// Write the difference of two wrapping bytes.
+static void WriteByteDelta(Serializer& dest, unsigned char value, unsigned char base)
+{
+	dest.WriteVLE(ZigZag((signed char)(value - base)));
+}
+
+static unsigned char ReadByteDelta(Deserializer& source, unsigned char base)
+{
+	return (unsigned char)(base + UnZigZag(source.ReadVLE()));
+}
+
+/// FNV-1a over raw bytes. Float bits are hashed as they are, so any difference at all shows.
+static unsigned HashBytes(unsigned hash, const void* data, unsigned size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (unsigned i = 0; i < size; i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return hash;
+}
+
+static unsigned GetNumBlocks(unsigned count)
+{
+	return (count + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+}
+
+static unsigned GetRemainingSize(const Deserializer& source)
+{
+	return source.GetSize() - source.GetPosition();
+}
+
+/// Write fish exactly: a copy stepped from them must match bit for bit.
+static void WriteExactState(Serializer& dest, const FlockState& state, unsigned first, unsigned count)
+{
+	for (unsigned i = first; i < first + count; i++)
+	{
+		dest.WriteVector3(state.position[i]);
+		dest.WriteVector3(state.velocity[i]);
+	}
+}
+
+static void ReadExactState(Deserializer& source, unsigned count, PODVector<Vector3>& positions,
+	PODVector<Vector3>& velocities)
+{
+	unsigned first = positions.Size();
+	positions.Resize(first + count);
+	velocities.Resize(first + count);
+	for (unsigned i = first; i < first + count; i++)
+	{
+		positions[i] = source.ReadVector3();
+		velocities[i] = source.ReadVector3();
+	}
+}
+
+/// Write everything a client needs to step its own copy of the flocks from this step on.
+static void WriteSetup(const FlockManager& flocks, Serializer& dest)
+{
+	const TerrainField* terrainField = flocks.GetTerrainField();
+	dest.WriteUInt(flocks.GetStepCount());
+	dest.WriteFloat(flocks.GetStepRate());
+	dest.WriteFloat(terrainField && terrainField->IsBaked() ? terrainField->GetCellSize() : 0.0f);
+
+	unsigned numFlocks = flocks.GetNumFlocks();
+	dest.WriteVLE(numFlocks);
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		const BoidSet* flock = flocks.GetFlock(i);
+		// Vector kernels sum neighbours in a different order from the scalar one, so both sides must use the same
+		dest.WriteUByte((unsigned char)flock->GetKernel());
+		dest.WriteUByte((unsigned char)flock->GetNeighbourMode());
+		dest.WriteVLE(flock->GetTopologicalNeighbours());
+		dest.WriteFloat(flock->GetNeighbourSkin());
+		// Fish near a player get full steering and the rest drift, so the distance is part of the rules
+		dest.WriteFloat(flock->GetLodSettings().fullDistance);
+		const BoidParameters& parameters = flock->GetParameters();
+		for (unsigned j = 0; j < NUM_PARAMETER_FIELDS; j++)
+			dest.WriteFloat(parameters.*PARAMETER_FIELDS[j]);
+		dest.WriteUInt(flock->GetRandomState());
+		dest.WriteVLE(flock->GetNumBoids());
+		WriteExactState(dest, flock->GetState(), 0, flock->GetNumBoids());
+	}
+
+	PODVector<unsigned> avoidances;
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		for (unsigned j = 0; j < numFlocks; j++)
+		{
+			if (flocks.GetAvoidance(flocks.GetFlock(i), flocks.GetFlock(j)))
+			{
+				avoidances.Push(i);
+				avoidances.Push(j);
+			}
+		}
+	}
+	dest.WriteVLE(avoidances.Size() / 2);
+	for (unsigned i = 0; i < avoidances.Size(); i++)
+		dest.WriteVLE(avoidances[i]);
+
+	// Players set before the setup were recorded only for clients already set up
+	const PODVector<Vector3>& players = flocks.GetPlayers();
+	dest.WriteVLE(players.Size());
+	for (unsigned i = 0; i < players.Size(); i++)
+		dest.WriteVector3(players[i]);
+}
+
+FlockReplicator::FlockReplicator(Context* context, FlockManager* flocks) :
+	Object(context),
+	flocks_(flocks),
+	sequence_(0),
+	appliedSequence_(0),
+	interestRadius_(0.0f),
+	distantInterval_(1),
+	mode_(FLOCK_REPLICATION_SNAPSHOTS),
+	checkStep_(0),
+	simulating_(false),
+	setupRequested_(false),
+	serverStep_(0),
+	serverStepAge_(0.0f),
+	bytesSent_(0),
+	boidsSent_(0),
+	messagesSent_(0)
+{
+	history_.Resize(SNAPSHOT_HISTORY);
+
+	SubscribeToEvent(E_NETWORKUPDATE, URHO3D_HANDLER(FlockReplicator, HandleNetworkUpdate));
+	SubscribeToEvent(E_NETWORKMESSAGE, URHO3D_HANDLER(FlockReplicator, HandleNetworkMessage));
+	SubscribeToEvent(E_CLIENTDISCONNECTED, URHO3D_HANDLER(FlockReplicator, HandleClientDisconnected));
+	SubscribeToEvent(E_SERVERDISCONNECTED, URHO3D_HANDLER(FlockReplicator, HandleServerDisconnected));
+	SubscribeToEvent(E_UPDATE, URHO3D_HANDLER(FlockReplicator, HandleUpdate));
+}
+
+void FlockReplicator::SetMode(FlockReplicationMode mode)
+{
+	mode_ = mode;
+	flocks_->SetDeterministic(mode == FLOCK_REPLICATION_DETERMINISTIC);
+	synchronized_.Clear();
+}
+
+void FlockReplicator::SetInterest(float radius, unsigned distantInterval)
+{
+	radius = Max(radius, 0.0f);
+	// Clients' baselines switch between the shared and their own histories, so start them over from full snapshots
+	if ((radius > 0.0f) != (interestRadius_ > 0.0f))
+	{
+		acknowledged_.Clear();
+		clientHistories_.Clear();
+	}
+	interestRadius_ = radius;
+	distantInterval_ = Max(distantInterval, 1u);
+}
+
+void FlockReplicator::ResetStatistics()
+{
+	bytesSent_ = 0;
+	boidsSent_ = 0;
+	messagesSent_ = 0;
+}
+
+void FlockReplicator::Capture(const FlockManager& flocks, unsigned sequence, FlockSnapshot& snapshot)
+{
+	snapshot.sequence = sequence;
+	snapshot.counts.Resize(flocks.GetNumFlocks());
+	snapshot.boids.Resize(flocks.GetNumBoids());
+
+	unsigned index = 0;
+	for (unsigned i = 0; i < flocks.GetNumFlocks(); i++)
+	{
+		const FlockState& state = flocks.GetFlock(i)->GetState();
+		snapshot.counts[i] = state.Size();
+		for (unsigned j = 0; j < state.Size(); j++, index++)
+		{
+			QuantizedBoid& boid = snapshot.boids[index];
+			const Vector3& position = state.position[j];
+			const Vector3& velocity = state.velocity[j];
+			boid.x = QuantizePosition(position.x_);
+			boid.y = QuantizePosition(position.y_);
+			boid.z = QuantizePosition(position.z_);
+			EncodeHeading(velocity, boid.headingU, boid.headingV);
+			boid.speed = (unsigned char)Clamp((int)(velocity.Length() / MAX_WIRE_SPEED * 255.0f + 0.5f), 0, 255);
+		}
+	}
+}
+
+void FlockReplicator::Encode(const FlockSnapshot& snapshot, const FlockSnapshot* baseline, VectorBuffer& message)
+{
+	message.Clear();
+	message.WriteUInt(snapshot.sequence);
+	message.WriteUInt(baseline ? baseline->sequence : 0);
+	message.WriteVLE(snapshot.counts.Size());
+
+	unsigned first = 0;
+	unsigned baselineFirst = 0;
+	PODVector<unsigned char> unchanged;
+	for (unsigned i = 0; i < snapshot.counts.Size(); i++)
+	{
+		unsigned count = snapshot.counts[i];
+		// Fish the client already has at the same index are sent as differences; the rest in full
+		unsigned numDeltas = 0;
+		if (baseline && i < baseline->counts.Size())
+			numDeltas = Min(count, baseline->counts[i]);
+
+		// Box corner of the flock, snapped so it rarely moves
+		int minX = M_MAX_INT;
+		int minY = M_MAX_INT;
+		int minZ = M_MAX_INT;
+		int maxX = M_MIN_INT;
+		int maxY = M_MIN_INT;
+		int maxZ = M_MIN_INT;
+		for (unsigned j = first; j < first + count; j++)
+		{
+			const QuantizedBoid& boid = snapshot.boids[j];
+			minX = Min(minX, boid.x);
+			minY = Min(minY, boid.y);
+			minZ = Min(minZ, boid.z);
+			maxX = Max(maxX, boid.x);
+			maxY = Max(maxY, boid.y);
+			maxZ = Max(maxZ, boid.z);
+		}
+		int boxX = count ? (int)floorf((float)minX / BOX_QUANTA) : 0;
+		int boxY = count ? (int)floorf((float)minY / BOX_QUANTA) : 0;
+		int boxZ = count ? (int)floorf((float)minZ / BOX_QUANTA) : 0;
+		// A clamped full position would become the baseline every later delta builds on, so it would never heal
+		bool wide = count && (maxX - boxX * BOX_QUANTA > MAX_BOX_OFFSET || maxY - boxY * BOX_QUANTA > MAX_BOX_OFFSET ||
+			maxZ - boxZ * BOX_QUANTA > MAX_BOX_OFFSET);
+
+		message.WriteVLE(count);
+		message.WriteShort((short)boxX);
+		message.WriteShort((short)boxY);
+		message.WriteShort((short)boxZ);
+		message.WriteBool(wide);
+
+		// Fish identical to their baseline, such as distant ones held back by interest management, cost one bit
+		unchanged.Resize((numDeltas + 7) / 8);
+		bool anyUnchanged = false;
+		for (unsigned j = 0; j < unchanged.Size(); j++)
+			unchanged[j] = 0;
+		for (unsigned j = 0; j < numDeltas; j++)
+		{
+			if (IsSameBoid(snapshot.boids[first + j], baseline->boids[baselineFirst + j]))
+			{
+				unchanged[j >> 3] |= (unsigned char)(1 << (j & 7));
+				anyUnchanged = true;
+			}
+		}
+		if (numDeltas)
+		{
+			message.WriteBool(anyUnchanged);
+			if (anyUnchanged)
+				message.Write(&unchanged[0], unchanged.Size());
+		}
+
+		for (unsigned j = 0; j < count; j++)
+		{
+			const QuantizedBoid& boid = snapshot.boids[first + j];
+			if (j < numDeltas)
+			{
+				if (anyUnchanged && (unchanged[j >> 3] & (1 << (j & 7))))
+					continue;
+				const QuantizedBoid& base = baseline->boids[baselineFirst + j];
+				message.WriteVLE(ZigZag(boid.x - base.x));
+				message.WriteVLE(ZigZag(boid.y - base.y));
+				message.WriteVLE(ZigZag(boid.z - base.z));
+				WriteByteDelta(message, boid.headingU, base.headingU);
+				WriteByteDelta(message, boid.headingV, base.headingV);
+				WriteByteDelta(message, boid.speed, base.speed);
+			}
+			else
+			{
+				if (wide)
+				{
+					message.WriteVLE((unsigned)(boid.x - boxX * BOX_QUANTA));
+					message.WriteVLE((unsigned)(boid.y - boxY * BOX_QUANTA));
+					message.WriteVLE((unsigned)(boid.z - boxZ * BOX_QUANTA));
+				}
+				else
+				{
+					message.WriteUShort((unsigned short)(boid.x - boxX * BOX_QUANTA));
+					message.WriteUShort((unsigned short)(boid.y - boxY * BOX_QUANTA));
+					message.WriteUShort((unsigned short)(boid.z - boxZ * BOX_QUANTA));
+				}
+				message.WriteUByte(boid.headingU);
+				message.WriteUByte(boid.headingV);
+				message.WriteUByte(boid.speed);
+			}
+		}
+
+		first += count;
+		if (baseline && i < baseline->counts.Size())
+			baselineFirst += baseline->counts[i];
+	}
+}
+
+void FlockReplicator::ReadHeader(Deserializer& message, unsigned& sequence, unsigned& baselineSequence)
+{
+	sequence = message.ReadUInt();
+	baselineSequence = message.ReadUInt();
+}
+
+bool FlockReplicator::Decode(Deserializer& message, const FlockSnapshot* baseline, FlockSnapshot& snapshot)
+{
+	unsigned numFlocks = message.ReadVLE();
+	if (numFlocks > GetRemainingSize(message) / MIN_FLOCK_BYTES)
+		return false;
+	snapshot.counts.Resize(numFlocks);
+	snapshot.boids.Clear();
+
+	unsigned baselineFirst = 0;
+	PODVector<unsigned char> unchanged;
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		unsigned count = message.ReadVLE();
+		int boxX = message.ReadShort();
+		int boxY = message.ReadShort();
+		int boxZ = message.ReadShort();
+		bool wide = message.ReadBool();
+		unsigned numDeltas = 0;
+		if (baseline && i < baseline->counts.Size())
+			numDeltas = Min(count, baseline->counts[i]);
+
+		bool anyUnchanged = numDeltas && message.ReadBool();
+		unsigned numUnchanged = 0;
+		unchanged.Resize((numDeltas + 7) / 8);
+		if (anyUnchanged)
+		{
+			if (message.Read(&unchanged[0], unchanged.Size()) != unchanged.Size())
+				return false;
+			for (unsigned j = 0; j < numDeltas; j++)
+				numUnchanged += (unchanged[j >> 3] >> (j & 7)) & 1;
+		}
+		// Every fish sent takes at least one byte per field
+		if (count - numUnchanged > GetRemainingSize(message) / MIN_BOID_BYTES)
+			return false;
+
+		snapshot.counts[i] = count;
+		unsigned first = snapshot.boids.Size();
+		snapshot.boids.Resize(first + count);
+		for (unsigned j = 0; j < count; j++)
+		{
+			QuantizedBoid& boid = snapshot.boids[first + j];
+			if (j < numDeltas)
+			{
+				const QuantizedBoid& base = baseline->boids[baselineFirst + j];
+				if (anyUnchanged && (unchanged[j >> 3] & (1 << (j & 7))))
+				{
+					boid = base;
+					continue;
+				}
+				if (message.IsEof())
+					return false;
+				boid.x = base.x + UnZigZag(message.ReadVLE());
+				boid.y = base.y + UnZigZag(message.ReadVLE());
+				boid.z = base.z + UnZigZag(message.ReadVLE());
+				boid.headingU = ReadByteDelta(message, base.headingU);
+				boid.headingV = ReadByteDelta(message, base.headingV);
+				boid.speed = ReadByteDelta(message, base.speed);
+			}
+			else
+			{
+				if (message.IsEof())
+					return false;
+				if (wide)
+				{
+					boid.x = boxX * BOX_QUANTA + (int)message.ReadVLE();
+					boid.y = boxY * BOX_QUANTA + (int)message.ReadVLE();
+					boid.z = boxZ * BOX_QUANTA + (int)message.ReadVLE();
+				}
+				else
+				{
+					boid.x = boxX * BOX_QUANTA + message.ReadUShort();
+					boid.y = boxY * BOX_QUANTA + message.ReadUShort();
+					boid.z = boxZ * BOX_QUANTA + message.ReadUShort();
+				}
+				boid.headingU = message.ReadUByte();
+				boid.headingV = message.ReadUByte();
+				boid.speed = message.ReadUByte();
+			}
+		}
+
+		if (baseline && i < baseline->counts.Size())
+			baselineFirst += baseline->counts[i];
+	}
+	return true;
+}
+
+void FlockReplicator::ApplyInterest(const FlockSnapshot& snapshot, const FlockSnapshot* baseline, const Vector3& viewer,
+	float radius, unsigned distantInterval, FlockSnapshot& view)
+{
+	view = snapshot;
+	if (!baseline)
+		return;
+
+	// Compared in quanta, so the fish need not be dequantized
+	float radius2 = radius * POSITION_QUANTA_PER_UNIT * radius * POSITION_QUANTA_PER_UNIT;
+	Vector3 center = viewer * POSITION_QUANTA_PER_UNIT;
+	distantInterval = Max(distantInterval, 1u);
+
+	unsigned first = 0;
+	unsigned baselineFirst = 0;
+	for (unsigned i = 0; i < snapshot.counts.Size() && i < baseline->counts.Size(); i++)
+	{
+		unsigned numDeltas = Min(snapshot.counts[i], baseline->counts[i]);
+		for (unsigned j = 0; j < numDeltas; j++)
+		{
+			const QuantizedBoid& boid = snapshot.boids[first + j];
+			Vector3 offset((float)boid.x - center.x_, (float)boid.y - center.y_, (float)boid.z - center.z_);
+			// Distant fish take turns, so each still moves every few updates and none is starved
+			if (offset.LengthSquared() >= radius2 && (snapshot.sequence + first + j) % distantInterval)
+				view.boids[first + j] = baseline->boids[baselineFirst + j];
+		}
+		first += snapshot.counts[i];
+		baselineFirst += baseline->counts[i];
+	}
+}
+
+void FlockReplicator::ComputeChecksums(const FlockManager& flocks, FlockChecksums& checksums)
+{
+	checksums.step = flocks.GetStepCount();
+	checksums.counts.Resize(flocks.GetNumFlocks());
+	checksums.hashes.Clear();
+
+	for (unsigned i = 0; i < flocks.GetNumFlocks(); i++)
+	{
+		const FlockState& state = flocks.GetFlock(i)->GetState();
+		checksums.counts[i] = state.Size();
+		for (unsigned first = 0; first < state.Size(); first += CHECKSUM_BLOCK_SIZE)
+		{
+			unsigned hash = 2166136261u;
+			unsigned end = Min(first + CHECKSUM_BLOCK_SIZE, state.Size());
+			for (unsigned j = first; j < end; j++)
+			{
+				hash = HashBytes(hash, &state.position[j], sizeof(Vector3));
+				hash = HashBytes(hash, &state.velocity[j], sizeof(Vector3));
+			}
+			checksums.hashes.Push(hash);
+		}
+	}
+}
+
+void FlockReplicator::HandleNetworkUpdate(StringHash eventType, VariantMap& eventData)
+{
+	Network* network = GetSubsystem<Network>();
+	if (!network->IsServerRunning() || !flocks_->GetNumFlocks())
+		return;
+
+	const Vector<SharedPtr<Connection> >& connections = network->GetClientConnections();
+	if (mode_ == FLOCK_REPLICATION_DETERMINISTIC)
+	{
+		SendDeterministicUpdate(connections);
+		return;
+	}
+	if (connections.Empty())
+		return;
+
+	FlockSnapshot& snapshot = StoreSnapshot(history_, ++sequence_);
+	Capture(*flocks_, sequence_, snapshot);
+
+	messages_.Clear();
+	for (unsigned i = 0; i < connections.Size(); ++i)
+	{
+		Connection* connection = connections[i];
+		if (!connection->GetSceneLoaded())
+			continue;
+
+		HashMap<Connection*, unsigned>::ConstIterator acked = acknowledged_.Find(connection);
+		unsigned ackedSequence = acked != acknowledged_.End() ? acked->second_ : 0;
+		VectorBuffer* message;
+
+		if (interestRadius_ > 0.0f)
+		{
+			// Each client is shown a different subset of the fish, so it has its own history and its own encode
+			Vector<FlockSnapshot>& history = clientHistories_[connection];
+			if (history.Empty())
+				history.Resize(SNAPSHOT_HISTORY);
+			const FlockSnapshot* baseline = FindSnapshot(history, ackedSequence);
+			ApplyInterest(snapshot, baseline, connection->GetPosition(), interestRadius_, distantInterval_, view_);
+			Encode(view_, baseline, viewMessage_);
+			// Stored after encoding: the slot may still hold the baseline
+			StoreSnapshot(history, sequence_) = view_;
+			message = &viewMessage_;
+		}
+		else
+		{
+			const FlockSnapshot* baseline = FindSnapshot(history_, ackedSequence);
+			// Every encoded message holds at least its header, so an empty one has not been encoded yet
+			message = &messages_[baseline ? baseline->sequence : 0];
+			if (!message->GetSize())
+				Encode(snapshot, baseline, *message);
+		}
+
+		// Unreliable and unordered: a lost snapshot is simply superseded by the next one
+		connection->SendMessage(MSG_FLOCKSNAPSHOT, false, false, *message);
+		bytesSent_ += message->GetSize();
+		boidsSent_ += snapshot.boids.Size();
+		messagesSent_++;
+	}
+}
+
+void FlockReplicator::SendDeterministicUpdate(const Vector<SharedPtr<Connection> >& connections)
+{
+	flocks_->SetRecordEvents(true);
+
+	// Every copy rebuilds its neighbour lists at the setup's step, so a new copy starts in step with the others
+	bool setup = false;
+	for (unsigned i = 0; i < connections.Size(); ++i)
+	{
+		if (connections[i]->GetSceneLoaded() && !synchronized_.Contains(connections[i]))
+			setup = true;
+	}
+	if (setup)
+		flocks_->InvalidateNeighbourLists();
+	SendEvents();
+
+	if (setup)
+	{
+		VectorBuffer message;
+		WriteSetup(*flocks_, message);
+		for (unsigned i = 0; i < connections.Size(); ++i)
+		{
+			Connection* connection = connections[i];
+			if (!connection->GetSceneLoaded() || synchronized_.Contains(connection))
+				continue;
+			connection->SendMessage(MSG_FLOCKSETUP, true, true, message);
+			synchronized_.Insert(connection);
+			bytesSent_ += message.GetSize();
+			boidsSent_ += flocks_->GetNumBoids();
+			messagesSent_++;
+		}
+	}
+
+	// The step count restarts when the flocks are recreated
+	unsigned step = flocks_->GetStepCount();
+	if (step - checkStep_ < CHECK_INTERVAL_STEPS && step >= checkStep_)
+		return;
+	checkStep_ = step;
+
+	FlockChecksums checksums;
+	ComputeChecksums(*flocks_, checksums);
+	VectorBuffer message;
+	message.WriteUInt(checksums.step);
+	message.WriteVLE(checksums.counts.Size());
+	for (unsigned i = 0; i < checksums.counts.Size(); i++)
+		message.WriteVLE(checksums.counts[i]);
+	for (unsigned i = 0; i < checksums.hashes.Size(); i++)
+		message.WriteUInt(checksums.hashes[i]);
+
+	for (unsigned i = 0; i < connections.Size(); ++i)
+	{
+		if (!synchronized_.Contains(connections[i]))
+			continue;
+		// Unreliable: the next checksums will catch whatever a lost one would have
+		connections[i]->SendMessage(MSG_FLOCKCHECK, false, false, message);
+		bytesSent_ += message.GetSize();
+		boidsSent_ += flocks_->GetNumBoids();
+		messagesSent_++;
+	}
+}
+
+void FlockReplicator::SendEvents()
+{
+	const PODVector<FlockEvent>& events = flocks_->GetEvents();
+	if (events.Empty())
+		return;
+
+	const PODVector<Vector3>& players = flocks_->GetRecordedPlayers();
+	unsigned player = 0;
+	VectorBuffer message;
+	message.WriteVLE(events.Size());
+	for (unsigned i = 0; i < events.Size(); i++)
+	{
+		message.WriteUInt(events[i].step);
+		message.WriteVLE(events[i].flock);
+		message.WriteUByte(events[i].type);
+		message.WriteVLE(events[i].value);
+		// Exact, like the flock state: the flee forces of every copy must come out the same
+		if (events[i].type == FLOCK_EVENT_PLAYERS)
+		{
+			for (unsigned j = 0; j < events[i].value; j++)
+				message.WriteVector3(players[player++]);
+		}
+	}
+	flocks_->ClearEvents();
+
+	// Reliable and in order with setups and corrections, so a client sees the changes in the order they happened
+	const Vector<SharedPtr<Connection> >& connections = GetSubsystem<Network>()->GetClientConnections();
+	for (unsigned i = 0; i < connections.Size(); ++i)
+	{
+		if (!synchronized_.Contains(connections[i]))
+			continue;
+		connections[i]->SendMessage(MSG_FLOCKEVENTS, true, true, message);
+		bytesSent_ += message.GetSize();
+		messagesSent_++;
+	}
+}
+
+void FlockReplicator::SendCorrection(Connection* connection, Deserializer& request)
+{
+	// A new setup goes out with the next network update
+	if (request.ReadBool() || !synchronized_.Contains(connection))
+	{
+		synchronized_.Erase(connection);
+		return;
+	}
+
+	unsigned numFlocks = flocks_->GetNumFlocks();
+	PODVector<unsigned> flockIndices;
+	Vector<PODVector<unsigned> > blocks;
+	unsigned numRequests = request.ReadVLE();
+	if (numRequests > GetRemainingSize(request) / 2)
+		return;
+	for (unsigned i = 0; i < numRequests; i++)
+	{
+		unsigned flock = request.ReadVLE();
+		unsigned numBlocks = request.ReadVLE();
+		if (numBlocks > GetRemainingSize(request))
+			return;
+		PODVector<unsigned> flockBlocks;
+		for (unsigned j = 0; j < numBlocks; j++)
+		{
+			unsigned block = request.ReadVLE();
+			if (flock < numFlocks && block < GetNumBlocks(flocks_->GetFlock(flock)->GetNumBoids()))
+				flockBlocks.Push(block);
+		}
+		if (flock < numFlocks)
+		{
+			flockIndices.Push(flock);
+			blocks.Push(flockBlocks);
+		}
+	}
+	if (flockIndices.Empty())
+		return;
+
+	// The corrected fish were built into different lists on the client, so every copy rebuilds at this step. The
+	// rebuild event goes out first so this client applies it before the correction, like the others
+	flocks_->InvalidateNeighbourLists();
+	SendEvents();
+
+	VectorBuffer message;
+	message.WriteUInt(flocks_->GetStepCount());
+	message.WriteVLE(flockIndices.Size());
+	unsigned numBoids = 0;
+	for (unsigned i = 0; i < flockIndices.Size(); i++)
+	{
+		const BoidSet* flock = flocks_->GetFlock(flockIndices[i]);
+		const FlockState& state = flock->GetState();
+		message.WriteVLE(flockIndices[i]);
+		message.WriteVLE(state.Size());
+		message.WriteUInt(flock->GetRandomState());
+		message.WriteVLE(blocks[i].Size());
+		for (unsigned j = 0; j < blocks[i].Size(); j++)
+		{
+			unsigned first = blocks[i][j] * CHECKSUM_BLOCK_SIZE;
+			unsigned count = Min(CHECKSUM_BLOCK_SIZE, state.Size() - first);
+			message.WriteVLE(blocks[i][j]);
+			WriteExactState(message, state, first, count);
+			numBoids += count;
+		}
+	}
+
+	connection->SendMessage(MSG_FLOCKCORRECTION, true, true, message);
+	bytesSent_ += message.GetSize();
+	boidsSent_ += numBoids;
+	messagesSent_++;
+}
+
+void FlockReplicator::HandleNetworkMessage(StringHash eventType, VariantMap& eventData)
+{
+	using namespace NetworkMessage;
+
+	int id = eventData[P_MESSAGEID].GetInt();
+	if (id < MSG_FLOCKSNAPSHOT || id > MSG_FLOCKCORRECTION)
+		return;
+
+	// Clients only send acknowledgements and resync requests; everything else comes from the server
+	bool fromClient = id == MSG_FLOCKACK || id == MSG_FLOCKRESYNC;
+	if (fromClient != GetSubsystem<Network>()->IsServerRunning())
+		return;
+
+	Connection* connection = static_cast<Connection*>(eventData[P_CONNECTION].GetPtr());
+	const PODVector<unsigned char>& data = eventData[P_DATA].GetBuffer();
+	MemoryBuffer message(data);
+
+	switch (id)
+	{
+	case MSG_FLOCKSNAPSHOT:
+		ReceiveSnapshot(connection, message);
+		break;
+
+	case MSG_FLOCKACK:
+		{
+			// Acknowledgements may arrive out of order; only ever move forward
+			unsigned sequence = message.ReadUInt();
+			unsigned& acked = acknowledged_[connection];
+			if (sequence > acked && sequence <= sequence_)
+				acked = sequence;
+		}
+		break;
+
+	case MSG_FLOCKSETUP:
+		ReceiveSetup(connection, message);
+		break;
+
+	case MSG_FLOCKEVENTS:
+		ReceiveEvents(message);
+		break;
+
+	case MSG_FLOCKCHECK:
+		if (simulating_)
+		{
+			FlockChecksums checksums;
+			checksums.step = message.ReadUInt();
+			unsigned numFlocks = message.ReadVLE();
+			if (numFlocks > GetRemainingSize(message))
+				break;
+			checksums.counts.Resize(numFlocks);
+			unsigned numBlocks = 0;
+			for (unsigned i = 0; i < numFlocks; i++)
+			{
+				checksums.counts[i] = message.ReadVLE();
+				numBlocks += GetNumBlocks(checksums.counts[i]);
+			}
+			if (numBlocks > GetRemainingSize(message) / sizeof(unsigned))
+				break;
+			checksums.hashes.Resize(numBlocks);
+			for (unsigned i = 0; i < numBlocks; i++)
+				checksums.hashes[i] = message.ReadUInt();
+
+			// Sent as soon as taken, so the newest tells the client where the server is
+			if (checksums.step >= serverStep_)
+			{
+				serverStep_ = checksums.step;
+				serverStepAge_ = 0.0f;
+			}
+			// Only a step the client has yet to reach can be compared
+			if (checksums.step > flocks_->GetStepCount())
+				pendingChecks_.Push(checksums);
+		}
+		break;
+
+	case MSG_FLOCKRESYNC:
+		SendCorrection(connection, message);
+		break;
+
+	case MSG_FLOCKCORRECTION:
+		ReceiveCorrection(message);
+		break;
+	}
+}
+
+void FlockReplicator::HandleClientDisconnected(StringHash eventType, VariantMap& eventData)
+{
+	using namespace ClientDisconnected;
+
+	Connection* connection = static_cast<Connection*>(eventData[P_CONNECTION].GetPtr());
+	acknowledged_.Erase(connection);
+	clientHistories_.Erase(connection);
+	synchronized_.Erase(connection);
+}
+
+void FlockReplicator::HandleServerDisconnected(StringHash eventType, VariantMap& eventData)
+{
+	simulating_ = false;
+	setupRequested_ = false;
+	pendingEvents_.Clear();
+	pendingCorrections_.Clear();
+	pendingChecks_.Clear();
+	flocks_->ClearQueuedPlayers();
+	flocks_->SetStepLimit(M_MAX_UNSIGNED);
+
+	// A server started anew numbers its snapshots from 1 again, and none of the old ones may serve as its baseline
+	appliedSequence_ = 0;
+	for (unsigned i = 0; i < history_.Size(); i++)
+		history_[i].sequence = 0;
+}
+
+void FlockReplicator::HandleUpdate(StringHash eventType, VariantMap& eventData)
+{
+	using namespace Update;
+
+	Connection* connection = GetSubsystem<Network>()->GetServerConnection();
+	if (!simulating_ || !connection)
+		return;
+
+	serverStepAge_ += eventData[P_TIMESTEP].GetFloat();
+	ApplyPending(connection);
+
+	unsigned step = flocks_->GetStepCount();
+	unsigned estimate = serverStep_ + (unsigned)(serverStepAge_ * flocks_->GetStepRate());
+	if (estimate > step + MAX_CLIENT_LAG_STEPS && !setupRequested_)
+	{
+		// After a long stall, starting over is cheaper than catching up step by step
+		VectorBuffer request;
+		request.WriteBool(true);
+		connection->SendMessage(MSG_FLOCKRESYNC, true, true, request);
+		setupRequested_ = true;
+	}
+
+	// Stop at the next step something is queued for, so it is applied exactly there
+	unsigned limit = estimate > CLIENT_DELAY_STEPS ? estimate - CLIENT_DELAY_STEPS : 0;
+	if (!pendingEvents_.Empty())
+		limit = Min(limit, pendingEvents_[0].step);
+	for (unsigned i = 0; i < pendingChecks_.Size(); i++)
+		limit = Min(limit, pendingChecks_[i].step);
+	flocks_->SetStepLimit(limit);
+}
+
+void FlockReplicator::ReceiveSetup(Connection* connection, Deserializer& message)
+{
+	unsigned step = message.ReadUInt();
+	float stepRate = message.ReadFloat();
+	float terrainCellSize = message.ReadFloat();
+	unsigned numFlocks = message.ReadVLE();
+	if (numFlocks != flocks_->GetNumFlocks())
+		URHO3D_LOGWARNING("Flock setup for " + String(numFlocks) + " flocks, " + String(flocks_->GetNumFlocks()) +
+			" created");
+
+	flocks_->SetRecordEvents(false);
+	flocks_->SetDeterministic(true);
+	flocks_->SetStepRate(stepRate);
+	flocks_->SetStepCount(step);
+
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		SteeringKernelType kernel = (SteeringKernelType)message.ReadUByte();
+		BoidNeighbourMode neighbourMode = (BoidNeighbourMode)message.ReadUByte();
+		unsigned topologicalNeighbours = message.ReadVLE();
+		float neighbourSkin = message.ReadFloat();
+		float fullDistance = message.ReadFloat();
+		BoidParameters parameters;
+		for (unsigned j = 0; j < NUM_PARAMETER_FIELDS; j++)
+			parameters.*PARAMETER_FIELDS[j] = message.ReadFloat();
+		unsigned randomState = message.ReadUInt();
+		unsigned count = message.ReadVLE();
+		if (count > GetRemainingSize(message) / EXACT_BOID_BYTES)
+		{
+			URHO3D_LOGWARNING("Malformed flock setup");
+			return;
+		}
+		positions_.Clear();
+		velocities_.Clear();
+		ReadExactState(message, count, positions_, velocities_);
+		if (i >= flocks_->GetNumFlocks())
+			continue;
+
+		BoidSet* flock = flocks_->GetFlock(i);
+		flock->SetKernel(kernel < MAX_KERNEL_TYPES ? kernel : KERNEL_SCALAR);
+		if (flock->GetKernel() != kernel)
+			URHO3D_LOGWARNING("Flock steering kernel unavailable; the flock will drift and be corrected more often");
+		flock->SetNeighbourMode(neighbourMode);
+		flock->SetTopologicalNeighbours(topologicalNeighbours);
+		flock->SetNeighbourSkin(neighbourSkin);
+		BoidLodSettings lodSettings = flock->GetLodSettings();
+		lodSettings.fullDistance = fullDistance;
+		flock->SetLodSettings(lodSettings);
+		flock->SetParameters(parameters);
+
+		while (flock->GetNumBoids() > count)
+			flock->Despawn(flock->GetHandle(flock->GetNumBoids() - 1));
+		if (flock->GetNumBoids() < count)
+			flock->Spawn(count - flock->GetNumBoids());
+		if (flock->GetNumBoids() < count)
+			URHO3D_LOGWARNING("Flock pool too small for the server's " + String(count) + " fish");
+		if (count)
+			flock->SetExactState(0, &positions_[0], &velocities_[0], count);
+		flock->SetRandomState(randomState);
+	}
+
+	unsigned numAvoidances = message.ReadVLE();
+	for (unsigned i = 0; i < flocks_->GetNumFlocks(); i++)
+	{
+		for (unsigned j = 0; j < flocks_->GetNumFlocks(); j++)
+			flocks_->SetAvoidance(flocks_->GetFlock(i), flocks_->GetFlock(j), false);
+	}
+	for (unsigned i = 0; i < numAvoidances && !message.IsEof(); i++)
+	{
+		unsigned flock = message.ReadVLE();
+		unsigned other = message.ReadVLE();
+		if (flock < flocks_->GetNumFlocks() && other < flocks_->GetNumFlocks())
+			flocks_->SetAvoidance(flocks_->GetFlock(flock), flocks_->GetFlock(other), true);
+	}
+
+	flocks_->ClearQueuedPlayers();
+	unsigned numPlayers = message.IsEof() ? 0 : message.ReadVLE();
+	if (numPlayers <= GetRemainingSize(message) / sizeof(Vector3))
+	{
+		positions_.Resize(numPlayers);
+		for (unsigned i = 0; i < numPlayers; i++)
+			positions_[i] = message.ReadVector3();
+		flocks_->QueuePlayers(step, positions_);
+	}
+
+	// The heightmap comes with the scene, so baking it the same way gives the server's field
+	Scene* scene = connection->GetScene();
+	Terrain* terrain = scene ? scene->GetComponent<Terrain>(true) : nullptr;
+	if (terrainCellSize > 0.0f && terrain)
+	{
+		terrainField_.Bake(terrain, terrainCellSize);
+		flocks_->SetTerrainField(&terrainField_);
+	}
+	else
+		flocks_->SetTerrainField(nullptr);
+
+	flocks_->InvalidateNeighbourLists();
+	pendingEvents_.Clear();
+	pendingCorrections_.Clear();
+	pendingChecks_.Clear();
+	simulating_ = true;
+	setupRequested_ = false;
+	serverStep_ = step;
+	serverStepAge_ = 0.0f;
+	flocks_->SetStepLimit(step);
+}
+
+void FlockReplicator::ReceiveEvents(Deserializer& message)
+{
+	if (!simulating_)
+		return;
+
+	unsigned count = message.ReadVLE();
+	if (count > GetRemainingSize(message) / MIN_EVENT_BYTES)
+	{
+		URHO3D_LOGWARNING("Malformed flock events");
+		return;
+	}
+	for (unsigned i = 0; i < count; i++)
+	{
+		FlockEvent event;
+		event.step = message.ReadUInt();
+		event.flock = message.ReadVLE();
+		event.type = message.ReadUByte();
+		event.value = message.ReadVLE();
+		if (event.type == FLOCK_EVENT_PLAYERS)
+		{
+			if (event.value > GetRemainingSize(message) / sizeof(Vector3))
+			{
+				URHO3D_LOGWARNING("Malformed flock events");
+				return;
+			}
+			positions_.Resize(event.value);
+			for (unsigned j = 0; j < event.value; j++)
+				positions_[j] = message.ReadVector3();
+			// The manager applies them itself between the steps of one update, so they do not hold the flocks
+			flocks_->QueuePlayers(event.step, positions_);
+		}
+		// Corrections are queued only from their own message
+		else if (event.type != FLOCK_EVENT_CORRECTION)
+			pendingEvents_.Push(event);
+	}
+}
+
+void FlockReplicator::ReceiveCorrection(Deserializer& message)
+{
+	if (!simulating_)
+		return;
+
+	unsigned step = message.ReadUInt();
+	unsigned numFlocks = message.ReadVLE();
+	if (numFlocks > GetRemainingSize(message))
+	{
+		URHO3D_LOGWARNING("Malformed flock correction");
+		return;
+	}
+	for (unsigned i = 0; i < numFlocks; i++)
+	{
+		FlockCorrection correction;
+		correction.step = step;
+		correction.flock = message.ReadVLE();
+		correction.count = message.ReadVLE();
+		correction.randomState = message.ReadUInt();
+		unsigned numBlocks = message.ReadVLE();
+		if (numBlocks > GetNumBlocks(correction.count))
+		{
+			URHO3D_LOGWARNING("Malformed flock correction");
+			return;
+		}
+		for (unsigned j = 0; j < numBlocks; j++)
+		{
+			unsigned block = message.ReadVLE();
+			unsigned first = block * CHECKSUM_BLOCK_SIZE;
+			if (first >= correction.count)
+			{
+				URHO3D_LOGWARNING("Malformed flock correction");
+				return;
+			}
+			unsigned count = Min(CHECKSUM_BLOCK_SIZE, correction.count - first);
+			if (count > GetRemainingSize(message) / EXACT_BOID_BYTES)
+			{
+				URHO3D_LOGWARNING("Malformed flock correction");
+				return;
+			}
+			correction.blocks.Push(block);
+			ReadExactState(message, count, correction.positions, correction.velocities);
+		}
+
+		FlockEvent event = { step, correction.flock, FLOCK_EVENT_CORRECTION, 0 };
+		pendingEvents_.Push(event);
+		pendingCorrections_.Push(correction);
+	}
+}
+
+void FlockReplicator::ApplyPending(Connection* connection)
+{
+	unsigned step = flocks_->GetStepCount();
+	unsigned numFlocks = flocks_->GetNumFlocks();
+
+	// Anything that arrived too late is applied now; the checksums will show if that left a difference
+	unsigned applied = 0;
+	while (applied < pendingEvents_.Size() && pendingEvents_[applied].step <= step)
+	{
+		const FlockEvent& event = pendingEvents_[applied++];
+		if (event.type == FLOCK_EVENT_CORRECTION)
+		{
+			ApplyCorrection(pendingCorrections_.Front());
+			pendingCorrections_.Erase(0);
+			continue;
+		}
+		if (event.type == FLOCK_EVENT_REBUILD)
+		{
+			flocks_->InvalidateNeighbourLists();
+			continue;
+		}
+		if (event.flock >= numFlocks)
+			continue;
+
+		BoidSet* flock = flocks_->GetFlock(event.flock);
+		if (event.type == FLOCK_EVENT_SPAWN)
+			flock->Spawn(event.value);
+		else if (event.type == FLOCK_EVENT_DESPAWN && event.value < flock->GetNumBoids())
+			flock->Despawn(flock->GetHandle(event.value));
+	}
+	if (applied)
+		pendingEvents_.Erase(0, applied);
+
+	for (unsigned i = 0; i < pendingChecks_.Size();)
+	{
+		const FlockChecksums& expected = pendingChecks_[i];
+		if (expected.step > step)
+		{
+			++i;
+			continue;
+		}
+		if (expected.step < step)
+		{
+			pendingChecks_.Erase(i);
+			continue;
+		}
+
+		// Ask for every block that differs, and for all of a flock whose size differs
+		ComputeChecksums(*flocks_, checksums_);
+		VectorBuffer request;
+		request.WriteBool(false);
+		unsigned numRequests = 0;
+		VectorBuffer requests;
+		unsigned expectedFirst = 0;
+		unsigned actualFirst = 0;
+		for (unsigned j = 0; j < expected.counts.Size() && j < checksums_.counts.Size(); j++)
+		{
+			unsigned numBlocks = GetNumBlocks(expected.counts[j]);
+			bool sizeMatches = expected.counts[j] == checksums_.counts[j];
+			PODVector<unsigned> blocks;
+			for (unsigned k = 0; k < numBlocks; k++)
+			{
+				if (!sizeMatches || expected.hashes[expectedFirst + k] != checksums_.hashes[actualFirst + k])
+					blocks.Push(k);
+			}
+			if (!sizeMatches || !blocks.Empty())
+			{
+				requests.WriteVLE(j);
+				requests.WriteVLE(blocks.Size());
+				for (unsigned k = 0; k < blocks.Size(); k++)
+					requests.WriteVLE(blocks[k]);
+				numRequests++;
+			}
+			expectedFirst += numBlocks;
+			actualFirst += GetNumBlocks(checksums_.counts[j]);
+		}
+		if (numRequests)
+		{
+			request.WriteVLE(numRequests);
+			request.Write(requests.GetData(), requests.GetSize());
+			connection->SendMessage(MSG_FLOCKRESYNC, true, true, request);
+		}
+		pendingChecks_.Erase(i);
+	}
+}
+
+void FlockReplicator::ApplyCorrection(const FlockCorrection& correction)
+{
+	if (correction.flock >= flocks_->GetNumFlocks())
+		return;
+
+	BoidSet* flock = flocks_->GetFlock(correction.flock);
+	while (flock->GetNumBoids() > correction.count)
+		flock->Despawn(flock->GetHandle(flock->GetNumBoids() - 1));
+	if (flock->GetNumBoids() < correction.count)
+		flock->Spawn(correction.count - flock->GetNumBoids());
+	flock->SetRandomState(correction.randomState);
+
+	unsigned first = 0;
+	for (unsigned i = 0; i < correction.blocks.Size(); i++)
+	{
+		unsigned begin = correction.blocks[i] * CHECKSUM_BLOCK_SIZE;
+		unsigned count = Min(CHECKSUM_BLOCK_SIZE, correction.count - begin);
+		flock->SetExactState(begin, &correction.positions[first], &correction.velocities[first], count);
+		first += count;
+	}
+	flocks_->InvalidateNeighbourLists();
+}
+
+void FlockReplicator::ReceiveSnapshot(Connection* connection, Deserializer& message)
+{
+	unsigned sequence;
+	unsigned baselineSequence;
+	ReadHeader(message, sequence, baselineSequence);
+
+	// Late arrivals are older than what is already shown
+	if (sequence <= appliedSequence_)
+		return;
+
+	const FlockSnapshot* baseline = nullptr;
+	if (baselineSequence)
+	{
+		baseline = FindSnapshot(history_, baselineSequence);
+		if (!baseline)
+			return;
+	}
+
+	// Decode into a scratch copy first; the baseline may live in the history slot being replaced
+	FlockSnapshot snapshot;
+	if (!Decode(message, baseline, snapshot))
+	{
+		URHO3D_LOGWARNING("Malformed flock snapshot " + String(sequence));
+		return;
+	}
+	snapshot.sequence = sequence;
+	appliedSequence_ = sequence;
+
+	unsigned first = 0;
+	for (unsigned i = 0; i < snapshot.counts.Size() && i < flocks_->GetNumFlocks(); i++)
+	{
+		unsigned count = snapshot.counts[i];
+		positions_.Resize(count);
+		velocities_.Resize(count);
+		for (unsigned j = 0; j < count; j++)
+		{
+			const QuantizedBoid& boid = snapshot.boids[first + j];
+			positions_[j] = Vector3((float)boid.x, (float)boid.y, (float)boid.z) / POSITION_QUANTA_PER_UNIT;
+			velocities_[j] = DecodeHeading(boid.headingU, boid.headingV) * (boid.speed / 255.0f * MAX_WIRE_SPEED);
+		}
+		flocks_->SetReplicatedState(i, count ? &positions_[0] : nullptr, count ? &velocities_[0] : nullptr, count);
+		first += count;
+	}
+
+	StoreSnapshot(history_, sequence) = snapshot;
+
+	VectorBuffer ack;
+	ack.WriteUInt(sequence);
+	connection->SendMessage(MSG_FLOCKACK, false, false, ack);
+}
+
+const FlockSnapshot* FlockReplicator::FindSnapshot(const Vector<FlockSnapshot>& history, unsigned sequence)
+{
+	const FlockSnapshot& snapshot = history[sequence % SNAPSHOT_HISTORY];
+	return sequence && snapshot.sequence == sequence ? &snapshot : nullptr;
+}
+
+FlockSnapshot& FlockReplicator::StoreSnapshot(Vector<FlockSnapshot>& history, unsigned sequence)
+{
+	FlockSnapshot& snapshot = history[sequence % SNAPSHOT_HISTORY];
+	snapshot.sequence = sequence;
+	return snapshot;
+}
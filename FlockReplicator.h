@@ -0,0 +1,216 @@
+#pragma once
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Container/HashSet.h>
+#include <Urho3D/Core/Object.h>
+#include <Urho3D/IO/VectorBuffer.h>
+
+#include "FlockManager.h"
+#include "TerrainField.h"
+
+namespace Urho3D
+{
+	class Connection;
+	class Deserializer;
+}
+
+using namespace Urho3D;
+
+/// Server to client: the quantized state of every flock, delta encoded against the client's last acknowledged one.
+static const int MSG_FLOCKSNAPSHOT = 40;
+/// Client to server: sequence number of the newest flock snapshot the client has applied.
+static const int MSG_FLOCKACK = 41;
+/// Server to client, once: exact flock state, tuning and random state for a client to simulate the flocks itself.
+static const int MSG_FLOCKSETUP = 42;
+/// Server to client: spawns, despawns, list rebuilds and player moves, each with the step it happened at.
+static const int MSG_FLOCKEVENTS = 43;
+/// Server to client, every few steps: checksums of the flock state in blocks of fish.
+static const int MSG_FLOCKCHECK = 44;
+/// Client to server: blocks whose checksums did not match, or a request for a new setup.
+static const int MSG_FLOCKRESYNC = 45;
+/// Server to client: exact state of requested blocks.
+static const int MSG_FLOCKCORRECTION = 46;
+
+/// How the server sends the flocks.
+enum FlockReplicationMode
+{
+	/// Quantized state of every fish at every network update.
+	FLOCK_REPLICATION_SNAPSHOTS = 0,
+	/// State once, then clients step their own copy and only drifted fish are corrected.
+	FLOCK_REPLICATION_DETERMINISTIC
+};
+
+/// One fish as it goes on the wire.
+struct QuantizedBoid
+{
+	/// Position in quanta from the world origin. Only the offset from the flock's box is sent in full.
+	int x;
+	int y;
+	int z;
+	/// Octahedral encoding of the swim direction.
+	unsigned char headingU;
+	unsigned char headingV;
+	unsigned char speed;
+};
+
+/// Quantized state of all flocks at one server network update.
+struct FlockSnapshot
+{
+	/// Starts at 1; 0 means no snapshot.
+	unsigned sequence = 0;
+	/// Fish per flock.
+	PODVector<unsigned> counts;
+	/// Fish of all flocks, concatenated in flock order.
+	PODVector<QuantizedBoid> boids;
+};
+
+/// Block checksums of all flocks at one step.
+struct FlockChecksums
+{
+	unsigned step = 0;
+	/// Fish per flock.
+	PODVector<unsigned> counts;
+	/// Checksum of each block of fish, of all flocks concatenated in flock order.
+	PODVector<unsigned> hashes;
+};
+
+/// Exact state of some blocks of one flock at one step.
+struct FlockCorrection
+{
+	unsigned step;
+	unsigned flock;
+	/// Fish in the flock and the state of its random generator.
+	unsigned count;
+	unsigned randomState;
+	/// Corrected blocks, and their fish concatenated.
+	PODVector<unsigned> blocks;
+	PODVector<Vector3> positions;
+	PODVector<Vector3> velocities;
+};
+
+/// Replaces per-node replication of the fish with one message per network update. On the server it quantizes the
+/// state of every flock and sends each client the difference from the last snapshot that client acknowledged. On
+/// the client it decodes the snapshots into the flocks' LOCAL fish and interpolates between the last two.
+///
+/// In deterministic mode the server instead sends each client the exact state once, and the client steps its own
+/// copy of the flocks a few steps behind the server. The server then sends only spawns and despawns, the exact shark
+/// positions each step was run with, and a few bytes of block checksums per second; a client whose blocks stop
+/// matching, usually because an event reached it after its step, asks for just those blocks.
+class FlockReplicator : public Object
+{
+	URHO3D_OBJECT(FlockReplicator, Object);
+
+public:
+	/// Construct for the flocks of a manager, which must outlive the replicator.
+	FlockReplicator(Context* context, FlockManager* flocks);
+
+	/// Server: choose how the flocks are sent. Deterministic mode also makes the server's flocks deterministic.
+	void SetMode(FlockReplicationMode mode);
+	FlockReplicationMode GetMode() const { return mode_; }
+	/// Server, snapshot mode: send fish beyond radius of a client's position only every distantInterval network
+	/// updates, staggered across the fish, so upload follows the number of fish near each client rather than the
+	/// size of the flocks. A radius of 0 sends every fish every update.
+	void SetInterest(float radius, unsigned distantInterval);
+	/// Client: return whether the flocks are being simulated locally, so they should be stepped with Update rather
+	/// than UpdateReplicated.
+	bool IsSimulating() const { return simulating_; }
+
+	/// Return average bytes per message sent since the last reset.
+	float GetAverageMessageSize() const { return messagesSent_ ? (float)bytesSent_ / messagesSent_ : 0.0f; }
+	/// Return average bytes per fish per message sent since the last reset.
+	float GetAverageBytesPerBoid() const { return boidsSent_ ? (float)bytesSent_ / boidsSent_ : 0.0f; }
+	void ResetStatistics();
+
+	/// Quantize the latest state of the flocks.
+	static void Capture(const FlockManager& flocks, unsigned sequence, FlockSnapshot& snapshot);
+	/// Write a snapshot, as differences from baseline if one is given.
+	static void Encode(const FlockSnapshot& snapshot, const FlockSnapshot* baseline, VectorBuffer& message);
+	/// Return the sequence numbers of an encoded snapshot and of the baseline it needs, 0 if none.
+	static void ReadHeader(Deserializer& message, unsigned& sequence, unsigned& baselineSequence);
+	/// Read the rest of a snapshot after its header. Returns false if the message is malformed.
+	static bool Decode(Deserializer& message, const FlockSnapshot* baseline, FlockSnapshot& snapshot);
+	/// Build the snapshot a client at viewer is shown: fish beyond radius keep their baseline state except on every
+	/// distantInterval-th update. Unchanged fish are encoded as a single bit.
+	static void ApplyInterest(const FlockSnapshot& snapshot, const FlockSnapshot* baseline, const Vector3& viewer,
+		float radius, unsigned distantInterval, FlockSnapshot& view);
+	/// Hash the exact latest state of the flocks in blocks of fish.
+	static void ComputeChecksums(const FlockManager& flocks, FlockChecksums& checksums);
+
+private:
+	/// Server: capture and send a snapshot to every client with a loaded scene.
+	void HandleNetworkUpdate(StringHash eventType, VariantMap& eventData);
+	/// Server: set up new clients, then send the events since the last update and, when due, checksums.
+	void SendDeterministicUpdate(const Vector<SharedPtr<Connection> >& connections);
+	/// Server: send recorded events to every set up client.
+	void SendEvents();
+	/// Server: answer a resync request with a correction, or with a new setup if the client asks for one.
+	void SendCorrection(Connection* connection, Deserializer& request);
+	/// Snapshots and deterministic updates on the client, acknowledgements and resync requests on the server.
+	void HandleNetworkMessage(StringHash eventType, VariantMap& eventData);
+	void HandleClientDisconnected(StringHash eventType, VariantMap& eventData);
+	void HandleServerDisconnected(StringHash eventType, VariantMap& eventData);
+	/// Client: apply what has reached its step and hold the flocks behind the server.
+	void HandleUpdate(StringHash eventType, VariantMap& eventData);
+	/// Client: decode a snapshot, show it and acknowledge it.
+	void ReceiveSnapshot(Connection* connection, Deserializer& message);
+	/// Return the snapshot of a sequence number if it is still in a history.
+	static const FlockSnapshot* FindSnapshot(const Vector<FlockSnapshot>& history, unsigned sequence);
+	/// Add a snapshot to a history, replacing the oldest.
+	static FlockSnapshot& StoreSnapshot(Vector<FlockSnapshot>& history, unsigned sequence);
+	/// Client: start simulating from a setup.
+	void ReceiveSetup(Connection* connection, Deserializer& message);
+	/// Client: queue received events and corrections until the flocks reach their step. Player moves are queued in
+	/// the flock manager.
+	void ReceiveEvents(Deserializer& message);
+	void ReceiveCorrection(Deserializer& message);
+	/// Client: apply queued events and corrections up to the current step and compare a checksum taken at it.
+	void ApplyPending(Connection* connection);
+	void ApplyCorrection(const FlockCorrection& correction);
+
+	FlockManager* flocks_;
+	/// Recent snapshots by sequence number modulo the history size: sent ones on the server, applied ones on the
+	/// client.
+	Vector<FlockSnapshot> history_;
+	/// Server: sequence number of the last snapshot sent.
+	unsigned sequence_;
+	/// Client: sequence number of the last snapshot applied.
+	unsigned appliedSequence_;
+	/// Server: newest snapshot each client has acknowledged.
+	HashMap<Connection*, unsigned> acknowledged_;
+	/// Server: messages of this update by baseline, so clients on the same baseline share one encode.
+	HashMap<unsigned, VectorBuffer> messages_;
+	/// Server, with interest management: snapshots as each client was shown them, and scratch for building one.
+	HashMap<Connection*, Vector<FlockSnapshot> > clientHistories_;
+	FlockSnapshot view_;
+	VectorBuffer viewMessage_;
+	float interestRadius_;
+	unsigned distantInterval_;
+	/// Client: scratch for dequantized flock state.
+	PODVector<Vector3> positions_;
+	PODVector<Vector3> velocities_;
+
+	FlockReplicationMode mode_;
+	/// Server: clients that have been sent a setup.
+	HashSet<Connection*> synchronized_;
+	/// Server: step of the last checksums sent.
+	unsigned checkStep_;
+	/// Client: whether a setup has been applied.
+	bool simulating_;
+	/// Client: whether a new setup has been asked for and not yet received.
+	bool setupRequested_;
+	/// Client: last step heard from the server, and seconds since.
+	unsigned serverStep_;
+	float serverStepAge_;
+	/// Client: received events in arrival order, corrections among them, waiting for their step.
+	PODVector<FlockEvent> pendingEvents_;
+	Vector<FlockCorrection> pendingCorrections_;
+	/// Client: checksums waiting for their step.
+	Vector<FlockChecksums> pendingChecks_;
+	/// Client: scratch for comparing checksums.
+	FlockChecksums checksums_;
+	/// Client: terrain baked from the replicated scene like the server's.
+	TerrainField terrainField_;
+
+	unsigned long long bytesSent_;
+	unsigned long long boidsSent_;
+	unsigned messagesSent_;
+};
@@ -0,0 +1,177 @@
+#include <Urho3D/Core/CoreEvents.h>
+#include <Urho3D/Core/Profiler.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/IO/Log.h>
+
+#include "FrameTraceRecorder.h"
+
+FrameTraceRecorder::FrameTraceRecorder(Context* context) :
+	Object(context),
+	firstFrame_(0),
+	endFrame_(0),
+	frameStart_(-1),
+	firstEventWritten_(false)
+{
+}
+
+FrameTraceRecorder::~FrameTraceRecorder()
+{
+	Stop();
+}
+
+bool FrameTraceRecorder::Start(const String& fileName, unsigned firstFrame, unsigned numFrames)
+{
+	if (IsRecording())
+	{
+		URHO3D_LOGERROR("Frame trace capture already running");
+		return false;
+	}
+	if (!GetSubsystem<Profiler>())
+	{
+		URHO3D_LOGERROR("Frame trace needs the profiler; build Urho3D with URHO3D_PROFILING");
+		return false;
+	}
+
+	SharedPtr<File> file(new File(context_, fileName, FILE_WRITE));
+	if (!file->IsOpen())
+	{
+		URHO3D_LOGERROR("Could not open frame trace file " + fileName);
+		return false;
+	}
+
+	// The frame in progress started before the capture clock, so the earliest frame that can be recorded is the next
+	file_ = file;
+	firstFrame_ = Max(firstFrame, GetSubsystem<Time>()->GetFrameNumber() + 1);
+	endFrame_ = firstFrame_ + Max(numFrames, 1u);
+	frameStart_ = -1;
+	firstEventWritten_ = false;
+	clock_.Reset();
+
+	const char* header = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	file_->Write(header, String::CStringLength(header));
+
+	SubscribeToEvent(E_BEGINFRAME, URHO3D_HANDLER(FrameTraceRecorder, HandleBeginFrame));
+	// Writing may block on disk; keep it off the main thread so it does not show up in the frames being captured
+	Run();
+
+	URHO3D_LOGINFO("Recording frames " + String(firstFrame_) + " to " + String(endFrame_ - 1) + " to " + fileName);
+	return true;
+}
+
+void FrameTraceRecorder::Stop()
+{
+	if (!IsRecording())
+		return;
+
+	UnsubscribeFromEvent(E_BEGINFRAME);
+
+	// The writer drains the queue once more after seeing shouldRun_ cleared
+	shouldRun_ = false;
+	dataReady_.Set();
+	Thread::Stop();
+
+	const char* footer = "\n]}\n";
+	file_->Write(footer, String::CStringLength(footer));
+	file_->Close();
+	file_.Reset();
+	pending_.Clear();
+}
+
+void FrameTraceRecorder::ThreadFunction()
+{
+	Vector<TraceEvent> writing;
+
+	for (;;)
+	{
+		dataReady_.Wait();
+		bool running = shouldRun_;
+
+		{
+			MutexLock lock(pendingMutex_);
+			writing.Swap(pending_);
+		}
+		WriteEvents(writing);
+		writing.Clear();
+
+		if (!running)
+			break;
+	}
+}
+
+void FrameTraceRecorder::HandleBeginFrame(StringHash eventType, VariantMap& eventData)
+{
+	using namespace BeginFrame;
+
+	// The profiler has just closed the previous frame, so its blocks hold that frame's totals
+	unsigned frame = eventData[P_FRAMENUMBER].GetUInt() - 1;
+	long long now = clock_.GetUSec(false);
+
+	if (frameStart_ >= 0 && frame >= firstFrame_ && frame < endFrame_)
+	{
+		const ProfilerBlock* root = GetSubsystem<Profiler>()->GetRootBlock();
+		long long start = frameStart_;
+		for (unsigned i = 0; i < root->children_.Size(); ++i)
+		{
+			const ProfilerBlock* child = root->children_[i];
+			if (child->frameCount_)
+			{
+				CollectBlock(child, start, frame);
+				start += child->frameTime_;
+			}
+		}
+
+		{
+			MutexLock lock(pendingMutex_);
+			for (unsigned i = 0; i < frameEvents_.Size(); ++i)
+				pending_.Push(frameEvents_[i]);
+		}
+		frameEvents_.Clear();
+		dataReady_.Set();
+	}
+
+	frameStart_ = now;
+
+	if (frame + 1 >= endFrame_)
+	{
+		URHO3D_LOGINFO("Frame trace capture finished");
+		Stop();
+	}
+}
+
+void FrameTraceRecorder::CollectBlock(const ProfilerBlock* block, long long start, unsigned frame)
+{
+	TraceEvent event;
+	event.name = block->name_;
+	event.start = start;
+	event.duration = block->frameTime_;
+	event.count = block->frameCount_;
+	event.frame = frame;
+	frameEvents_.Push(event);
+
+	for (unsigned i = 0; i < block->children_.Size(); ++i)
+	{
+		const ProfilerBlock* child = block->children_[i];
+		if (child->frameCount_)
+		{
+			CollectBlock(child, start, frame);
+			start += child->frameTime_;
+		}
+	}
+}
+
+void FrameTraceRecorder::WriteEvents(const Vector<TraceEvent>& events)
+{
+	String line;
+	for (unsigned i = 0; i < events.Size(); ++i)
+	{
+		const TraceEvent& event = events[i];
+		line.Clear();
+		if (firstEventWritten_)
+			line += ",\n";
+		line.AppendWithFormat("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%lld,\"dur\":%lld,"
+			"\"args\":{\"frame\":%u,\"count\":%u}}", event.name.CString(), event.start, event.duration, event.frame,
+			event.count);
+		file_->Write(line.CString(), line.Length());
+		firstEventWritten_ = true;
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <Urho3D/Core/Condition.h>
+#include <Urho3D/Core/Mutex.h>
+#include <Urho3D/Core/Object.h>
+#include <Urho3D/Core/Thread.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/IO/File.h>
+
+namespace Urho3D
+{
+	class ProfilerBlock;
+}
+
+using namespace Urho3D;
+
+/// One profiler block of one frame, laid out for the trace.
+struct TraceEvent
+{
+	String name;
+	/// Start in microseconds since the capture started.
+	long long start;
+	long long duration;
+	/// Times the block was entered during the frame.
+	unsigned count;
+	unsigned frame;
+};
+
+/// Streams the profiler tree of a range of frames to a Chrome trace-event JSON file (chrome://tracing or Perfetto).
+/// The tree of the last frame is copied out at the start of the next one; formatting and file writes happen on a
+/// background thread. The profiler only keeps per-frame totals, so sibling blocks are laid out one after another
+/// from their parent's start: durations and nesting are exact, positions within the parent are not.
+class FrameTraceRecorder : public Object, public Thread
+{
+	URHO3D_OBJECT(FrameTraceRecorder, Object);
+
+public:
+	/// Construct.
+	FrameTraceRecorder(Context* context);
+	/// Destruct. Finishes a running capture.
+	~FrameTraceRecorder();
+
+	/// Record numFrames frames starting at firstFrame, or at the next frame if that has passed. Returns false if the
+	/// profiler is not available, the file cannot be opened or a capture is already running.
+	bool Start(const String& fileName, unsigned firstFrame, unsigned numFrames);
+	/// Finish the capture: write the remaining frames and close the file.
+	void Stop();
+	/// Return whether a capture is running.
+	bool IsRecording() const { return file_.NotNull(); }
+
+	/// Write queued events until stopped.
+	virtual void ThreadFunction();
+
+private:
+	/// Copy out the previous frame's profiler tree if it is in the range.
+	void HandleBeginFrame(StringHash eventType, VariantMap& eventData);
+	/// Append a block and, laid out from its start, its children.
+	void CollectBlock(const ProfilerBlock* block, long long start, unsigned frame);
+	/// Format and write events to the file.
+	void WriteEvents(const Vector<TraceEvent>& events);
+
+	/// Output file. Only touched by the writer thread while it runs.
+	SharedPtr<File> file_;
+	unsigned firstFrame_;
+	unsigned endFrame_;
+	/// Capture clock.
+	HiresTimer clock_;
+	/// Start of the frame in progress on the capture clock, or -1 before the first one.
+	long long frameStart_;
+	/// Events of the frame being collected on the main thread.
+	Vector<TraceEvent> frameEvents_;
+	/// Events waiting for the writer thread.
+	Vector<TraceEvent> pending_;
+	Mutex pendingMutex_;
+	/// Signalled when events are queued or the capture stops.
+	Condition dataReady_;
+	/// Whether an event has been written, for the separators.
+	bool firstEventWritten_;
+};
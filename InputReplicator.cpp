@@ -0,0 +1,213 @@
+#include <Urho3D/Input/Controls.h>
+#include <Urho3D/IO/Log.h>
+#include <Urho3D/IO/MemoryBuffer.h>
+#include <Urho3D/IO/VectorBuffer.h>
+#include <Urho3D/Network/Connection.h>
+#include <Urho3D/Network/Network.h>
+#include <Urho3D/Network/NetworkEvents.h>
+
+#include "InputReplicator.h"
+
+/// Ticks the server stays behind the newest input it has, to ride out jitter.
+static const unsigned INPUT_JITTER_TICKS = 2;
+/// Backlog beyond which the server skips inputs to catch up with a client whose clock runs ahead.
+static const unsigned MAX_BUFFERED_TICKS = 8;
+/// Furthest an input may be ahead of the buffered ones. Further inputs are taken as corrupt unless a run of
+/// LEAP_INPUTS of them carries on from there, as after a long outage.
+static const unsigned MAX_TICK_LEAD = MAX_BUFFERED_TICKS * 4;
+static const unsigned LEAP_INPUTS = MAX_BUFFERED_TICKS;
+/// Inputs sent with every network update. Each input goes out this many times.
+static const unsigned INPUT_REDUNDANCY = 4;
+/// Most ticks one frame samples; a longer stall is dropped rather than sent as a burst.
+static const unsigned MAX_TICKS_PER_FRAME = 8;
+/// Size of one input on the wire.
+static const unsigned INPUT_BYTES = 16;
+
+InputBuffer::InputBuffer() :
+	nextTick(0),
+	newestTick(0),
+	leapTick(0),
+	numLeapInputs(0),
+	numRepeated(0),
+	numSkipped(0)
+{
+	for (unsigned i = 0; i < INPUT_BUFFER_SIZE; i++)
+		slots[i].tick = 0;
+	last.tick = 0;
+	last.buttons = 0;
+	last.yaw = 0.0f;
+	last.pitch = 0.0f;
+}
+
+void InputBuffer::Push(const PlayerInput& input)
+{
+	if (!input.tick || (nextTick && input.tick < nextTick))
+		return;
+
+	// Accepting a tick far ahead would skip the buffer to it and drop every later input as late
+	unsigned reference = Max(nextTick, newestTick);
+	if (reference && input.tick > reference && input.tick - reference > MAX_TICK_LEAD)
+	{
+		unsigned distance = input.tick > leapTick ? input.tick - leapTick : leapTick - input.tick;
+		numLeapInputs = numLeapInputs && distance <= MAX_TICK_LEAD ? numLeapInputs + 1 : 1;
+		leapTick = numLeapInputs > 1 ? Max(leapTick, input.tick) : input.tick;
+		if (numLeapInputs < LEAP_INPUTS)
+			return;
+
+		// The client really is there: start over from its inputs, holding the last one meanwhile
+		for (unsigned i = 0; i < INPUT_BUFFER_SIZE; i++)
+			slots[i].tick = 0;
+		nextTick = 0;
+		newestTick = 0;
+	}
+	numLeapInputs = 0;
+
+	PlayerInput& slot = slots[input.tick % INPUT_BUFFER_SIZE];
+	if (slot.tick == input.tick)
+		return;
+	slot = input;
+	newestTick = Max(newestTick, input.tick);
+}
+
+bool InputBuffer::Pop(PlayerInput& input)
+{
+	if (!newestTick)
+		return false;
+
+	if (!nextTick)
+		nextTick = newestTick > INPUT_JITTER_TICKS ? newestTick - INPUT_JITTER_TICKS : 1;
+
+	// The client's clock runs ahead, or its inputs arrived in a burst: drop the backlog instead of lagging behind
+	if (newestTick >= nextTick + MAX_BUFFERED_TICKS)
+	{
+		unsigned skipTo = newestTick - INPUT_JITTER_TICKS;
+		numSkipped += skipTo - nextTick;
+		nextTick = skipTo;
+	}
+
+	// The client is behind: hold its last input without using up a tick
+	if (nextTick > newestTick)
+	{
+		input = last;
+		numRepeated++;
+		return true;
+	}
+
+	const PlayerInput& slot = slots[nextTick % INPUT_BUFFER_SIZE];
+	if (slot.tick == nextTick)
+		last = slot;
+	else
+		numRepeated++;
+	nextTick++;
+	input = last;
+	return true;
+}
+
+InputReplicator::InputReplicator(Context* context) :
+	Object(context),
+	tickTime_(1.0f / 30.0f),
+	accumulator_(0.0f),
+	tick_(0)
+{
+	SubscribeToEvent(E_NETWORKUPDATE, URHO3D_HANDLER(InputReplicator, HandleNetworkUpdate));
+	SubscribeToEvent(E_NETWORKMESSAGE, URHO3D_HANDLER(InputReplicator, HandleNetworkMessage));
+	SubscribeToEvent(E_CLIENTDISCONNECTED, URHO3D_HANDLER(InputReplicator, HandleClientDisconnected));
+	SubscribeToEvent(E_SERVERDISCONNECTED, URHO3D_HANDLER(InputReplicator, HandleServerDisconnected));
+}
+
+void InputReplicator::SetTickRate(float ticksPerSecond)
+{
+	tickTime_ = 1.0f / Max(ticksPerSecond, 1.0f);
+}
+
+void InputReplicator::SampleControls(float timeStep, const Controls& controls)
+{
+	accumulator_ += timeStep;
+
+	unsigned ticks = 0;
+	while (accumulator_ >= tickTime_ && ticks < MAX_TICKS_PER_FRAME)
+	{
+		PlayerInput input;
+		input.tick = ++tick_;
+		input.buttons = controls.buttons_;
+		input.yaw = controls.yaw_;
+		input.pitch = controls.pitch_;
+		recent_.Push(input);
+		accumulator_ -= tickTime_;
+		ticks++;
+	}
+	if (accumulator_ >= tickTime_)
+		accumulator_ = fmodf(accumulator_, tickTime_);
+
+	if (recent_.Size() > INPUT_REDUNDANCY)
+		recent_.Erase(0, recent_.Size() - INPUT_REDUNDANCY);
+}
+
+bool InputReplicator::GetInput(Connection* connection, PlayerInput& input)
+{
+	HashMap<Connection*, InputBuffer>::Iterator buffer = buffers_.Find(connection);
+	return buffer != buffers_.End() && buffer->second_.Pop(input);
+}
+
+void InputReplicator::HandleNetworkUpdate(StringHash eventType, VariantMap& eventData)
+{
+	Connection* connection = GetSubsystem<Network>()->GetServerConnection();
+	if (!connection || recent_.Empty())
+		return;
+
+	VectorBuffer message;
+	message.WriteUByte((unsigned char)recent_.Size());
+	for (unsigned i = recent_.Size(); i-- > 0;)
+	{
+		message.WriteUInt(recent_[i].tick);
+		message.WriteUInt(recent_[i].buttons);
+		message.WriteFloat(recent_[i].yaw);
+		message.WriteFloat(recent_[i].pitch);
+	}
+	// Unreliable: every input is repeated in the next few messages anyway
+	connection->SendMessage(MSG_PLAYERINPUT, false, false, message);
+}
+
+void InputReplicator::HandleNetworkMessage(StringHash eventType, VariantMap& eventData)
+{
+	using namespace NetworkMessage;
+
+	if (eventData[P_MESSAGEID].GetInt() != MSG_PLAYERINPUT || !GetSubsystem<Network>()->IsServerRunning())
+		return;
+
+	Connection* connection = static_cast<Connection*>(eventData[P_CONNECTION].GetPtr());
+	const PODVector<unsigned char>& data = eventData[P_DATA].GetBuffer();
+	MemoryBuffer message(data);
+
+	unsigned count = message.ReadUByte();
+	if (count > (message.GetSize() - message.GetPosition()) / INPUT_BYTES)
+	{
+		URHO3D_LOGWARNING("Malformed player input");
+		return;
+	}
+
+	InputBuffer& buffer = buffers_[connection];
+	for (unsigned i = 0; i < count; i++)
+	{
+		PlayerInput input;
+		input.tick = message.ReadUInt();
+		input.buttons = message.ReadUInt();
+		input.yaw = message.ReadFloat();
+		input.pitch = message.ReadFloat();
+		buffer.Push(input);
+	}
+}
+
+void InputReplicator::HandleClientDisconnected(StringHash eventType, VariantMap& eventData)
+{
+	using namespace ClientDisconnected;
+
+	buffers_.Erase(static_cast<Connection*>(eventData[P_CONNECTION].GetPtr()));
+}
+
+void InputReplicator::HandleServerDisconnected(StringHash eventType, VariantMap& eventData)
+{
+	accumulator_ = 0.0f;
+	tick_ = 0;
+	recent_.Clear();
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <Urho3D/Container/HashMap.h>
+#include <Urho3D/Core/Object.h>
+
+namespace Urho3D
+{
+	class Connection;
+	class Controls;
+}
+
+using namespace Urho3D;
+
+/// Client to server: the client's latest inputs, newest first, each stamped with the client tick it was sampled at.
+static const int MSG_PLAYERINPUT = 47;
+
+/// Inputs an InputBuffer can hold ahead of the one being consumed.
+static const unsigned INPUT_BUFFER_SIZE = 32;
+
+/// Controls sampled at one client tick.
+struct PlayerInput
+{
+	/// Client tick, starting at 1.
+	unsigned tick;
+	unsigned buttons;
+	float yaw;
+	float pitch;
+};
+
+/// Server side queue of one client's inputs in tick order. Holds a couple of ticks back to absorb network jitter,
+/// repeats the last input when the next one is lost or late, and drops inputs when the client gets too far ahead.
+class InputBuffer
+{
+public:
+	InputBuffer();
+
+	/// Store a received input. Duplicates, inputs older than the next one to consume, and inputs too far ahead of the
+	/// others are ignored.
+	void Push(const PlayerInput& input);
+	/// Take the input for one server tick. Returns false until the client has sent anything.
+	bool Pop(PlayerInput& input);
+	/// Return how many server ticks repeated the previous input because the next one was missing.
+	unsigned GetNumRepeated() const { return numRepeated; }
+	/// Return how many inputs were skipped to catch up with the client.
+	unsigned GetNumSkipped() const { return numSkipped; }
+
+private:
+	/// Inputs by tick modulo the buffer size; a slot is valid for the tick stored in it.
+	PlayerInput slots[INPUT_BUFFER_SIZE];
+	/// Next client tick to consume, 0 before the first.
+	unsigned nextTick;
+	unsigned newestTick;
+	/// Newest of the recent inputs too far ahead, and how many arrived in a row close to each other.
+	unsigned leapTick;
+	unsigned numLeapInputs;
+	/// Input of the last tick consumed, repeated while the next is missing.
+	PlayerInput last;
+	unsigned numRepeated;
+	unsigned numSkipped;
+};
+
+/// Carries player controls from clients to the server one fixed tick at a time, instead of the latest controls only.
+/// The client samples its controls at the server's tick rate and sends the last few with every network update, so a
+/// lost packet costs nothing. The server buffers them per connection and hands out one per server tick.
+class InputReplicator : public Object
+{
+	URHO3D_OBJECT(InputReplicator, Object);
+
+public:
+	InputReplicator(Context* context);
+
+	/// Client: set the rate controls are sampled at. Should match the server's tick rate.
+	void SetTickRate(float ticksPerSecond);
+	/// Client: sample the controls for every tick this frame covers. Call every frame.
+	void SampleControls(float timeStep, const Controls& controls);
+	/// Server: take a client's input for the current tick. Returns false if the client has sent none yet.
+	bool GetInput(Connection* connection, PlayerInput& input);
+
+private:
+	/// Client: send the latest inputs to the server.
+	void HandleNetworkUpdate(StringHash eventType, VariantMap& eventData);
+	/// Server: buffer a client's inputs.
+	void HandleNetworkMessage(StringHash eventType, VariantMap& eventData);
+	void HandleClientDisconnected(StringHash eventType, VariantMap& eventData);
+	void HandleServerDisconnected(StringHash eventType, VariantMap& eventData);
+
+	/// Client: seconds per tick, frame time not yet sampled, and the last tick sampled.
+	float tickTime_;
+	float accumulator_;
+	unsigned tick_;
+	/// Client: the latest inputs, oldest first.
+	PODVector<PlayerInput> recent_;
+	/// Server: inputs of each client.
+	HashMap<Connection*, InputBuffer> buffers_;
+};
@@ -0,0 +1,122 @@
+#include <Urho3D/Math/MathDefs.h>
+
+#include "KdTree.h"
+
+#include <algorithm>
+
+/// Ranges this small are scanned linearly instead of split further.
+static const unsigned LEAF_SIZE = 8;
+
+/// Orders original point indices along one axis, for the median split.
+struct AxisLess
+{
+	const Vector3* positions;
+	unsigned axis;
+
+	bool operator()(unsigned a, unsigned b) const { return positions[a].Data()[axis] < positions[b].Data()[axis]; }
+};
+
+void KdTree::Build(const Vector3* positions, unsigned count)
+{
+	indices.Resize(count);
+	for (unsigned i = 0; i < count; ++i)
+		indices[i] = i;
+	axes.Resize(count);
+
+	BuildRange(positions, 0, count);
+
+	// Copy positions into tree order so queries read them sequentially
+	points.Resize(count);
+	for (unsigned i = 0; i < count; ++i)
+		points[i] = positions[indices[i]];
+}
+
+void KdTree::BuildRange(const Vector3* positions, unsigned begin, unsigned end)
+{
+	if (end - begin <= LEAF_SIZE)
+		return;
+
+	Vector3 minimum = positions[indices[begin]];
+	Vector3 maximum = minimum;
+	for (unsigned i = begin + 1; i < end; ++i)
+	{
+		const Vector3& p = positions[indices[i]];
+		minimum = Vector3(Min(minimum.x_, p.x_), Min(minimum.y_, p.y_), Min(minimum.z_, p.z_));
+		maximum = Vector3(Max(maximum.x_, p.x_), Max(maximum.y_, p.y_), Max(maximum.z_, p.z_));
+	}
+
+	Vector3 size = maximum - minimum;
+	unsigned axis = 0;
+	if (size.y_ > size.x_)
+		axis = 1;
+	if (size.z_ > size.Data()[axis])
+		axis = 2;
+
+	unsigned mid = (begin + end) / 2;
+	AxisLess less = { positions, axis };
+	std::nth_element(&indices[0] + begin, &indices[0] + mid, &indices[0] + end, less);
+	axes[mid] = (unsigned char)axis;
+
+	BuildRange(positions, begin, mid);
+	BuildRange(positions, mid + 1, end);
+}
+
+unsigned KdTree::QueryNearest(const Vector3& center, unsigned k, unsigned exclude, unsigned* found,
+	float* distances2) const
+{
+	unsigned numFound = 0;
+	if (k && !points.Empty())
+		Search(0, points.Size(), center, k, exclude, found, distances2, numFound);
+	return numFound;
+}
+
+/// Insert a candidate into the nearest-first result list if it is closer than the current k-th.
+static inline void Consider(unsigned index, float distance2, unsigned k, unsigned* found, float* distances2,
+	unsigned& numFound)
+{
+	if (numFound == k && distance2 >= distances2[k - 1])
+		return;
+
+	unsigned slot = numFound < k ? numFound++ : k - 1;
+	while (slot > 0 && distances2[slot - 1] > distance2)
+	{
+		found[slot] = found[slot - 1];
+		distances2[slot] = distances2[slot - 1];
+		--slot;
+	}
+	found[slot] = index;
+	distances2[slot] = distance2;
+}
+
+void KdTree::Search(unsigned begin, unsigned end, const Vector3& center, unsigned k, unsigned exclude, unsigned* found,
+	float* distances2, unsigned& numFound) const
+{
+	if (end - begin <= LEAF_SIZE)
+	{
+		for (unsigned i = begin; i < end; ++i)
+		{
+			if (indices[i] != exclude)
+				Consider(indices[i], (points[i] - center).LengthSquared(), k, found, distances2, numFound);
+		}
+		return;
+	}
+
+	unsigned mid = (begin + end) / 2;
+	unsigned axis = axes[mid];
+	if (indices[mid] != exclude)
+		Consider(indices[mid], (points[mid] - center).LengthSquared(), k, found, distances2, numFound);
+
+	float offset = center.Data()[axis] - points[mid].Data()[axis];
+	if (offset < 0.0f)
+	{
+		Search(begin, mid, center, k, exclude, found, distances2, numFound);
+		if (numFound < k || offset * offset < distances2[k - 1])
+			Search(mid + 1, end, center, k, exclude, found, distances2, numFound);
+	}
+	else
+	{
+		Search(mid + 1, end, center, k, exclude, found, distances2, numFound);
+		if (numFound < k || offset * offset < distances2[k - 1])
+			Search(begin, mid, center, k, exclude, found, distances2, numFound);
+	}
+}
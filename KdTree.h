@@ -0,0 +1,35 @@
+#pragma once
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector3.h>
+
+using namespace Urho3D;
+
+/// Balanced 3D k-d tree over a set of points, stored implicitly in one array: the median of each range is the node
+/// and the halves on either side are its subtrees. Rebuilt from scratch once per step. A k-nearest query costs about
+/// k log n no matter how densely the points are packed, unlike a radius query.
+class KdTree
+{
+public:
+	/// Rebuild the tree from point positions.
+	void Build(const Vector3* positions, unsigned count);
+	/// Find up to k points nearest to center, skipping the point with original index exclude. Writes their original
+	/// indices and squared distances nearest first and returns how many were found. Thread-safe.
+	unsigned QueryNearest(const Vector3& center, unsigned k, unsigned exclude, unsigned* found,
+		float* distances2) const;
+
+	unsigned GetNumPoints() const { return indices.Size(); }
+
+private:
+	/// Split a range on its widest axis at the median, then split both halves.
+	void BuildRange(const Vector3* positions, unsigned begin, unsigned end);
+	/// Visit a subtree, nearer half first, skipping halves that cannot beat the current k-th distance.
+	void Search(unsigned begin, unsigned end, const Vector3& center, unsigned k, unsigned exclude, unsigned* found,
+		float* distances2, unsigned& numFound) const;
+
+	/// Positions in tree order.
+	PODVector<Vector3> points;
+	/// Original index of each point in tree order.
+	PODVector<unsigned> indices;
+	/// Split axis of the node at each position; unused inside leaves.
+	PODVector<unsigned char> axes;
+};
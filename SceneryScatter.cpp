@@ -0,0 +1,305 @@
+#include <Urho3D/Core/Profiler.h>
+#include <Urho3D/Core/WorkQueue.h>
+#include <Urho3D/Graphics/StaticModelGroup.h>
+#include <Urho3D/Graphics/Terrain.h>
+#include <Urho3D/Scene/Node.h>
+
+#include "SceneryScatter.h"
+
+SceneryScatter::SceneryScatter() :
+	scale(1.0f),
+	castShadows(false),
+	area(-100.0f, -100.0f, 100.0f, 100.0f),
+	density(0.0f),
+	chunkPatches(8),
+	seed(1),
+	loadRadius(0.0f),
+	retainRadius(0.0f),
+	chunksPerFrame(1),
+	terrain(nullptr),
+	workQueue(nullptr),
+	chunkSize(1.0f)
+{
+}
+
+void SceneryScatter::SetModel(Model* model, Material* material, float scale)
+{
+	this->model = model;
+	this->material = material;
+	this->scale = scale;
+}
+
+void SceneryScatter::SetStreaming(float loadRadius, float retainRadius, unsigned chunksPerFrame)
+{
+	this->loadRadius = Max(loadRadius, 0.0f);
+	// Retaining past the load radius keeps a viewer on a chunk border from creating and recycling it every frame
+	this->retainRadius = Max(retainRadius, this->loadRadius);
+	this->chunksPerFrame = Max(chunksPerFrame, 1u);
+}
+
+void SceneryScatter::PlaceChunkWork(const WorkItem* item, unsigned threadIndex)
+{
+	const SceneryScatter* scatter = reinterpret_cast<const SceneryScatter*>(item->aux_);
+	SceneryChunk* chunk = reinterpret_cast<SceneryChunk*>(item->start_);
+	scatter->PlaceChunk(*chunk);
+}
+
+void SceneryScatter::Create(Node* parent, Terrain* terrain, WorkQueue* workQueue)
+{
+	URHO3D_PROFILE(CreateScenery);
+
+	Clear();
+	this->terrain = terrain;
+	this->parent = parent;
+	this->workQueue = workQueue;
+
+	// Chunks line up with the terrain's patches, which start at its corner; the terrain is centred on its node
+	const IntVector2& vertices = terrain->GetNumVertices();
+	const Vector3& spacing = terrain->GetSpacing();
+	Vector3 center = terrain->GetNode()->GetWorldPosition();
+	gridOrigin = Vector2(center.x_ - (vertices.x_ - 1) * spacing.x_ * 0.5f,
+		center.z_ - (vertices.y_ - 1) * spacing.z_ * 0.5f);
+	chunkSize = Max(terrain->GetPatchSize() * spacing.x_ * chunkPatches, M_EPSILON);
+
+	if (loadRadius > 0.0f)
+		return;
+
+	int minX = FloorToInt((area.min_.x_ - gridOrigin.x_) / chunkSize);
+	int minZ = FloorToInt((area.min_.y_ - gridOrigin.y_) / chunkSize);
+	int maxX = CeilToInt((area.max_.x_ - gridOrigin.x_) / chunkSize);
+	int maxZ = CeilToInt((area.max_.y_ - gridOrigin.y_) / chunkSize);
+	for (int z = minZ; z < maxZ; ++z)
+	{
+		for (int x = minX; x < maxX; ++x)
+			AddChunk(x, z);
+	}
+	LoadChunks(0);
+}
+
+void SceneryScatter::Update(const Vector3& viewer)
+{
+	if (loadRadius <= 0.0f || !parent)
+		return;
+
+	URHO3D_PROFILE(StreamScenery);
+
+	// Distances are measured from the viewer to chunk centres, in x and z
+	Vector2 view(viewer.x_, viewer.z_);
+	Vector2 halfChunk(chunkSize * 0.5f, chunkSize * 0.5f);
+
+	for (unsigned i = chunks.Size(); i-- > 0;)
+	{
+		Vector2 chunkCenter = gridOrigin + Vector2(chunks[i].x * chunkSize, chunks[i].z * chunkSize) + halfChunk;
+		if ((chunkCenter - view).Length() > retainRadius)
+		{
+			RecycleChunk(chunks[i]);
+			loaded.Erase(GetChunkKey(chunks[i].x, chunks[i].z));
+			chunks.Erase(i);
+		}
+	}
+
+	// Missing chunks of the area within the load radius, nearest first, up to the budget
+	int minX = FloorToInt((Max(view.x_ - loadRadius, area.min_.x_) - gridOrigin.x_) / chunkSize);
+	int minZ = FloorToInt((Max(view.y_ - loadRadius, area.min_.y_) - gridOrigin.y_) / chunkSize);
+	int maxX = CeilToInt((Min(view.x_ + loadRadius, area.max_.x_) - gridOrigin.x_) / chunkSize);
+	int maxZ = CeilToInt((Min(view.y_ + loadRadius, area.max_.y_) - gridOrigin.y_) / chunkSize);
+	unsigned first = chunks.Size();
+	for (unsigned n = 0; n < chunksPerFrame; ++n)
+	{
+		int nearestX = 0;
+		int nearestZ = 0;
+		float nearestDistance = M_INFINITY;
+		for (int z = minZ; z < maxZ; ++z)
+		{
+			for (int x = minX; x < maxX; ++x)
+			{
+				Vector2 chunkCenter = gridOrigin + Vector2(x * chunkSize, z * chunkSize) + halfChunk;
+				float distance = (chunkCenter - view).Length();
+				if (distance <= loadRadius && distance < nearestDistance && !loaded.Contains(GetChunkKey(x, z)))
+				{
+					nearestX = x;
+					nearestZ = z;
+					nearestDistance = distance;
+				}
+			}
+		}
+		if (nearestDistance == M_INFINITY)
+			break;
+		AddChunk(nearestX, nearestZ);
+	}
+	LoadChunks(first);
+}
+
+void SceneryScatter::AddChunk(int x, int z)
+{
+	// Chunks on the edge of the area only scatter over their part of it
+	Vector2 min(gridOrigin.x_ + x * chunkSize, gridOrigin.y_ + z * chunkSize);
+	Rect chunkArea(Max(min.x_, area.min_.x_), Max(min.y_, area.min_.y_), Min(min.x_ + chunkSize, area.max_.x_),
+		Min(min.y_ + chunkSize, area.max_.y_));
+
+	chunks.Resize(chunks.Size() + 1);
+	SceneryChunk& chunk = chunks.Back();
+	chunk.x = x;
+	chunk.z = z;
+	chunk.area = chunkArea;
+	loaded.Insert(GetChunkKey(x, z));
+}
+
+void SceneryScatter::LoadChunks(unsigned first)
+{
+	unsigned count = chunks.Size() - first;
+	if (!count)
+		return;
+
+	// Terrain queries only read once the node's cached world transform is clean, which Create made it
+	if (workQueue && workQueue->GetNumThreads() && count > 1)
+	{
+		for (unsigned i = first; i < chunks.Size(); ++i)
+		{
+			SharedPtr<WorkItem> item = workQueue->GetFreeItem();
+			item->priority_ = M_MAX_UNSIGNED;
+			item->workFunction_ = PlaceChunkWork;
+			item->aux_ = this;
+			item->start_ = &chunks[i];
+			workQueue->AddWorkItem(item);
+		}
+		workQueue->Complete(M_MAX_UNSIGNED);
+	}
+	else
+	{
+		for (unsigned i = first; i < chunks.Size(); ++i)
+			PlaceChunk(chunks[i]);
+	}
+
+	// Nodes can only be created on the main thread
+	for (unsigned i = first; i < chunks.Size(); ++i)
+		BuildChunk(chunks[i]);
+}
+
+void SceneryScatter::Clear()
+{
+	for (unsigned i = 0; i < chunks.Size(); ++i)
+	{
+		if (chunks[i].node)
+			chunks[i].node->Remove();
+	}
+	for (unsigned i = 0; i < pool.Size(); ++i)
+	{
+		if (pool[i])
+			pool[i]->Remove();
+	}
+	chunks.Clear();
+	loaded.Clear();
+	pool.Clear();
+}
+
+unsigned SceneryScatter::GetNumInstances() const
+{
+	unsigned count = 0;
+	for (unsigned i = 0; i < chunks.Size(); ++i)
+		count += chunks[i].spots.Size();
+	return count;
+}
+
+unsigned SceneryScatter::GetChunkSeed(int x, int z) const
+{
+	// Spread neighbouring chunks apart so their generators do not start in step
+	unsigned hash = seed * 2654435761u;
+	hash = (hash ^ (unsigned)x) * 2246822519u;
+	hash = (hash ^ (unsigned)z) * 3266489917u;
+	return hash ^ (hash >> 15);
+}
+
+void SceneryScatter::PlaceChunk(SceneryChunk& chunk) const
+{
+	// The same linear congruential generator as Urho3D's Rand(), with per-chunk state so chunks can be placed on any
+	// thread in any order
+	unsigned randomState = GetChunkSeed(chunk.x, chunk.z);
+	struct Generator
+	{
+		unsigned& state;
+		float operator ()(float range)
+		{
+			state = state * 214013 + 2531011;
+			return ((state >> 16) & 32767) * range / 32768.0f;
+		}
+	} random = {randomState};
+
+	Vector2 size(Max(chunk.area.Size().x_, 0.0f), Max(chunk.area.Size().y_, 0.0f));
+	// The fraction of an instance left over goes to chance, so density holds across chunks of any size
+	float expected = density * size.x_ * size.y_;
+	unsigned count = (unsigned)expected;
+	if (random(1.0f) < expected - count)
+		++count;
+
+	chunk.spots.Resize(count);
+	for (unsigned i = 0; i < count; ++i)
+	{
+		float x = random(size.x_);
+		float z = random(size.y_);
+		ScenerySpot& spot = chunk.spots[i];
+		spot.position = Vector3(chunk.area.min_.x_ + x, 0.0f, chunk.area.min_.y_ + z);
+		spot.position.y_ = terrain->GetHeight(spot.position);
+		// Create a rotation quaternion from up vector to terrain normal
+		spot.rotation = Quaternion(Vector3::UP, terrain->GetNormal(spot.position));
+	}
+}
+
+void SceneryScatter::BuildChunk(SceneryChunk& chunk)
+{
+	if (chunk.spots.Empty())
+		return;
+
+	Node* chunkNode = nullptr;
+	while (!chunkNode && !pool.Empty())
+	{
+		chunkNode = pool.Back();
+		pool.Pop();
+	}
+
+	StaticModelGroup* group;
+	if (chunkNode)
+	{
+		chunkNode->SetEnabled(true);
+		group = chunkNode->GetComponent<StaticModelGroup>();
+	}
+	else
+	{
+		chunkNode = parent->CreateChild("SceneryChunk", LOCAL);
+		group = chunkNode->CreateComponent<StaticModelGroup>();
+		group->SetModel(model);
+		group->SetMaterial(material);
+		group->SetCastShadows(castShadows);
+	}
+
+	// Move the instance nodes the chunk already has, then add or remove the difference
+	unsigned count = chunk.spots.Size();
+	unsigned reused = Min(group->GetNumInstanceNodes(), count);
+	for (unsigned i = 0; i < reused; ++i)
+		group->GetInstanceNode(i)->SetTransform(chunk.spots[i].position, chunk.spots[i].rotation, scale);
+	for (unsigned i = reused; i < count; ++i)
+	{
+		// Bare transform nodes; the group draws them all
+		Node* instanceNode = chunkNode->CreateChild(String::EMPTY, LOCAL);
+		instanceNode->SetTransform(chunk.spots[i].position, chunk.spots[i].rotation, scale);
+		group->AddInstanceNode(instanceNode);
+	}
+	while (group->GetNumInstanceNodes() > count)
+	{
+		Node* instanceNode = group->GetInstanceNode(group->GetNumInstanceNodes() - 1);
+		group->RemoveInstanceNode(instanceNode);
+		instanceNode->Remove();
+	}
+	chunk.node = chunkNode;
+}
+
+void SceneryScatter::RecycleChunk(SceneryChunk& chunk)
+{
+	if (!chunk.node)
+		return;
+
+	// A disabled node takes its group out of the octree; its instance nodes have no components of their own
+	chunk.node->SetEnabled(false);
+	pool.Push(chunk.node);
+	chunk.node.Reset();
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <Urho3D/Container/HashSet.h>
+#include <Urho3D/Container/Ptr.h>
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/Model.h>
+#include <Urho3D/Math/Quaternion.h>
+#include <Urho3D/Math/Rect.h>
+
+namespace Urho3D
+{
+	class Node;
+	class Terrain;
+	class WorkQueue;
+	struct WorkItem;
+}
+
+using namespace Urho3D;
+
+/// Placement of one scenery instance.
+struct ScenerySpot
+{
+	Vector3 position;
+	Quaternion rotation;
+};
+
+/// Square of scenery aligned to the terrain's patch grid, drawn by one StaticModelGroup.
+struct SceneryChunk
+{
+	/// Chunk grid coordinates.
+	int x;
+	int z;
+	/// World area the chunk's instances are placed in, the chunk square clipped to the scattered area.
+	Rect area;
+	/// Placements computed off the main thread, turned into instance nodes afterwards.
+	PODVector<ScenerySpot> spots;
+	/// Node holding the chunk's group and instance nodes, none if the chunk is empty.
+	WeakPtr<Node> node;
+};
+
+/// Scatters one model over a terrain in chunks of several terrain patches. Each chunk is one StaticModelGroup, so
+/// the octree holds one drawable and the renderer issues one instanced batch per chunk instead of per instance, and
+/// a chunk out of view is culled whole. Placements are computed in parallel on the WorkQueue; each chunk has its own
+/// random seed, so the scatter is the same on every peer whatever order the chunks are placed in.
+///
+/// With streaming on, only the chunks near a viewer exist. Chunks are created nearest first, a few per frame, as the
+/// viewer approaches, and recycled into a pool of disabled chunk nodes once it moves past a retention radius, so
+/// the node count and octree size depend on the radii rather than on the area.
+class SceneryScatter
+{
+public:
+	SceneryScatter();
+
+	/// Set the model and material of the instances, and their uniform scale.
+	void SetModel(Model* model, Material* material, float scale);
+	void SetCastShadows(bool enable) { castShadows = enable; }
+	/// Set the world x and z rectangle scattered over.
+	void SetArea(const Rect& area) { this->area = area; }
+	/// Set the instances per square world unit.
+	void SetDensity(float density) { this->density = Max(density, 0.0f); }
+	/// Set the side of a chunk in terrain patches.
+	void SetChunkPatches(unsigned patches) { chunkPatches = Max(patches, 1u); }
+	void SetSeed(unsigned seed) { this->seed = seed; }
+	/// Create chunks within loadRadius of the viewer passed to Update, at most chunksPerFrame per call, and recycle
+	/// chunks beyond retainRadius. A load radius of 0 scatters over the whole area at once.
+	void SetStreaming(float loadRadius, float retainRadius, unsigned chunksPerFrame);
+
+	/// Start scattering over a terrain, which must not move afterwards: over the whole area now, or as Update is
+	/// called when streaming. Chunks go under parent as LOCAL nodes.
+	void Create(Node* parent, Terrain* terrain, WorkQueue* workQueue);
+	/// Streaming: create and recycle chunks around the viewer. Call every frame.
+	void Update(const Vector3& viewer);
+	/// Remove every chunk, pooled ones included.
+	void Clear();
+
+	/// Return the number of chunks placed, empty ones included.
+	unsigned GetNumChunks() const { return chunks.Size(); }
+	/// Return the number of recycled chunk nodes waiting for reuse.
+	unsigned GetNumPooledChunks() const { return pool.Size(); }
+	/// Return the number of instances over all chunks.
+	unsigned GetNumInstances() const;
+
+private:
+	/// Add a chunk of the grid, to be placed by LoadChunks.
+	void AddChunk(int x, int z);
+	/// Place the chunks from first on, in parallel, then build their nodes.
+	void LoadChunks(unsigned first);
+	/// Compute the placements of one chunk. Thread-safe.
+	void PlaceChunk(SceneryChunk& chunk) const;
+	/// Give a placed chunk a group and instance nodes, reusing a pooled chunk node if there is one.
+	void BuildChunk(SceneryChunk& chunk);
+	/// Disable a chunk's node and keep it for reuse.
+	void RecycleChunk(SceneryChunk& chunk);
+	/// Return the random seed of a chunk.
+	unsigned GetChunkSeed(int x, int z) const;
+	/// Return the key of a chunk in the loaded set.
+	static unsigned GetChunkKey(int x, int z) { return ((unsigned)(x & 0xffff) << 16) | (unsigned)(z & 0xffff); }
+
+	static void PlaceChunkWork(const WorkItem* item, unsigned threadIndex);
+
+	SharedPtr<Model> model;
+	SharedPtr<Material> material;
+	float scale;
+	bool castShadows;
+	Rect area;
+	float density;
+	unsigned chunkPatches;
+	unsigned seed;
+	float loadRadius;
+	float retainRadius;
+	unsigned chunksPerFrame;
+	/// Terrain being scattered over, the node chunks go under, and the patch grid origin and chunk size, set by
+	/// Create.
+	Terrain* terrain;
+	WeakPtr<Node> parent;
+	WorkQueue* workQueue;
+	Vector2 gridOrigin;
+	float chunkSize;
+	/// Placed chunks, and their keys.
+	Vector<SceneryChunk> chunks;
+	HashSet<unsigned> loaded;
+	/// Disabled chunk nodes, with their group and instance nodes, waiting for reuse.
+	Vector<WeakPtr<Node> > pool;
+};
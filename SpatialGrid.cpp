@@ -0,0 +1,128 @@
+#include <Urho3D/Math/MathDefs.h>
+
+#include "SpatialGrid.h"
+
+SpatialGrid::SpatialGrid() :
+	cellSize(1.0f),
+	invCellSize(1.0f),
+	tableMask(0)
+{
+}
+
+void SpatialGrid::SetCellSize(float size)
+{
+	cellSize = Max(size, M_EPSILON);
+	invCellSize = 1.0f / cellSize;
+}
+
+void SpatialGrid::Build(const Vector3* positions, unsigned count)
+{
+	// Twice as many buckets as points keeps hash collisions between occupied cells rare
+	unsigned tableSize = NextPowerOfTwo(Max(count * 2, 64u));
+	tableMask = tableSize - 1;
+
+	cellStart.Resize(tableSize + 1);
+	for (unsigned i = 0; i <= tableSize; ++i)
+		cellStart[i] = 0;
+	pointCell.Resize(count);
+	sortedIndices.Resize(count);
+
+	for (unsigned i = 0; i < count; ++i)
+	{
+		const Vector3& p = positions[i];
+		unsigned cell = HashCell(CellCoord(p.x_), CellCoord(p.y_), CellCoord(p.z_));
+		pointCell[i] = cell;
+		++cellStart[cell + 1];
+	}
+
+	for (unsigned i = 1; i <= tableSize; ++i)
+		cellStart[i] += cellStart[i - 1];
+
+	// Scatter into buckets, using the end sentinel as a moving write cursor and restoring it afterwards
+	for (unsigned i = 0; i < count; ++i)
+		sortedIndices[cellStart[pointCell[i]]++] = i;
+	for (unsigned i = tableSize; i > 0; --i)
+		cellStart[i] = cellStart[i - 1];
+	cellStart[0] = 0;
+}
+
+void SpatialGrid::QueryRanges(const Vector3& center, float radius, PODVector<GridRange>& ranges) const
+{
+	QueryRanges(center, radius, ranges, 0, sortedIndices.Size());
+}
+
+void SpatialGrid::QueryRanges(const Vector3& center, float radius, PODVector<GridRange>& ranges, unsigned firstIndex,
+	unsigned endIndex) const
+{
+	if (sortedIndices.Empty() || firstIndex >= endIndex)
+		return;
+
+	bool narrow = firstIndex > 0 || endIndex < sortedIndices.Size();
+
+	int minX = CellCoord(center.x_ - radius);
+	int minY = CellCoord(center.y_ - radius);
+	int minZ = CellCoord(center.z_ - radius);
+	int maxX = CellCoord(center.x_ + radius);
+	int maxY = CellCoord(center.y_ + radius);
+	int maxZ = CellCoord(center.z_ + radius);
+	unsigned first = ranges.Size();
+
+	for (int z = minZ; z <= maxZ; ++z)
+	{
+		for (int y = minY; y <= maxY; ++y)
+		{
+			for (int x = minX; x <= maxX; ++x)
+			{
+				unsigned cell = HashCell(x, y, z);
+				GridRange range = { cellStart[cell], cellStart[cell + 1] };
+				if (narrow && range.begin != range.end)
+				{
+					// Buckets are in index order, so the wanted points are one contiguous part of the run
+					unsigned end = range.end;
+					range.begin = LowerBound(range.begin, end, firstIndex);
+					range.end = LowerBound(range.begin, end, endIndex);
+				}
+				if (range.begin == range.end)
+					continue;
+
+				// Two neighbouring cells may hash to the same bucket; visit each bucket only once
+				bool visited = false;
+				for (unsigned i = first; i < ranges.Size(); ++i)
+				{
+					if (ranges[i].begin == range.begin)
+					{
+						visited = true;
+						break;
+					}
+				}
+				if (!visited)
+					ranges.Push(range);
+			}
+		}
+	}
+}
+
+unsigned SpatialGrid::LowerBound(unsigned begin, unsigned end, unsigned index) const
+{
+	while (begin < end)
+	{
+		unsigned mid = (begin + end) / 2;
+		if (sortedIndices[mid] < index)
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	return begin;
+}
+
+void SpatialGrid::Query(const Vector3& center, float radius, PODVector<unsigned>& result) const
+{
+	PODVector<GridRange> ranges;
+	QueryRanges(center, radius, ranges);
+
+	for (unsigned i = 0; i < ranges.Size(); ++i)
+	{
+		for (unsigned j = ranges[i].begin; j < ranges[i].end; ++j)
+			result.Push(sortedIndices[j]);
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector3.h>
+
+using namespace Urho3D;
+
+/// Contiguous run of points in the grid's cell-sorted order.
+struct GridRange
+{
+	unsigned begin;
+	unsigned end;
+};
+
+/// Uniform spatial hash grid over a set of points. Rebuilt from scratch once per step with a counting sort,
+/// so that a radius query only has to visit the cells around the query point.
+class SpatialGrid
+{
+public:
+	SpatialGrid();
+
+	/// Set the cell edge length. Should be at least the usual query radius so that a query visits 27 cells.
+	void SetCellSize(float size);
+	/// Rebuild the grid from point positions. The sort is stable, so the points of a bucket stay in index order.
+	void Build(const Vector3* positions, unsigned count);
+	/// Append the runs of sorted points in all cells overlapping the query sphere. Runs are unique but may contain
+	/// points beyond the radius, so the caller still does its own distance test.
+	void QueryRanges(const Vector3& center, float radius, PODVector<GridRange>& ranges) const;
+	/// As above, but only for points whose original index is in [firstIndex, endIndex). Lets several point sets
+	/// concatenated into one build be queried separately.
+	void QueryRanges(const Vector3& center, float radius, PODVector<GridRange>& ranges, unsigned firstIndex,
+		unsigned endIndex) const;
+	/// Append the original indices of all points in cells overlapping the query sphere. Allocates scratch per call;
+	/// hot loops should keep their own range buffer and use QueryRanges.
+	void Query(const Vector3& center, float radius, PODVector<unsigned>& result) const;
+
+	float GetCellSize() const { return cellSize; }
+	unsigned GetNumPoints() const { return sortedIndices.Size(); }
+	/// Return original point indices in cell-sorted order.
+	const PODVector<unsigned>& GetSortedIndices() const { return sortedIndices; }
+
+private:
+	/// Return the first position in [begin, end) of the sorted order whose original index is not below index.
+	unsigned LowerBound(unsigned begin, unsigned end, unsigned index) const;
+	int CellCoord(float value) const { return (int)floorf(value * invCellSize); }
+	unsigned HashCell(int x, int y, int z) const
+	{
+		return (((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u)) & tableMask;
+	}
+
+	float cellSize;
+	float invCellSize;
+	unsigned tableMask;
+	/// Start of each hash bucket in the sorted order, with one extra end sentinel.
+	PODVector<unsigned> cellStart;
+	/// Hash bucket of each point, indexed by original point index.
+	PODVector<unsigned> pointCell;
+	PODVector<unsigned> sortedIndices;
+};
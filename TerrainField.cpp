@@ -0,0 +1,104 @@
+#include <Urho3D/Graphics/Terrain.h>
+#include <Urho3D/Math/MathDefs.h>
+#include <Urho3D/Scene/Node.h>
+
+#include "TerrainField.h"
+
+TerrainField::TerrainField() :
+	originX(0.0f),
+	originZ(0.0f),
+	cellSize(1.0f),
+	invCellSize(1.0f),
+	sizeX(0),
+	sizeZ(0)
+{
+}
+
+void TerrainField::Bake(const Terrain* terrain, float cellSize)
+{
+	cellSize = Max(cellSize, M_EPSILON);
+	this->cellSize = cellSize;
+
+	// The terrain is centred on its node
+	const IntVector2& vertices = terrain->GetNumVertices();
+	const Vector3& spacing = terrain->GetSpacing();
+	Vector3 center = terrain->GetNode()->GetWorldPosition();
+	float extentX = (vertices.x_ - 1) * spacing.x_;
+	float extentZ = (vertices.y_ - 1) * spacing.z_;
+
+	originX = center.x_ - extentX * 0.5f;
+	originZ = center.z_ - extentZ * 0.5f;
+	invCellSize = 1.0f / cellSize;
+	sizeX = Max((int)(extentX * invCellSize) + 1, 2);
+	sizeZ = Max((int)(extentZ * invCellSize) + 1, 2);
+	values.Resize(sizeX * sizeZ * 3);
+
+	for (int z = 0; z < sizeZ; ++z)
+	{
+		for (int x = 0; x < sizeX; ++x)
+		{
+			Vector3 position(originX + x * cellSize, 0.0f, originZ + z * cellSize);
+			values[(z * sizeX + x) * 3] = terrain->GetHeight(position);
+		}
+	}
+
+	// Central differences inside, one-sided at the edges
+	for (int z = 0; z < sizeZ; ++z)
+	{
+		for (int x = 0; x < sizeX; ++x)
+		{
+			int x0 = Max(x - 1, 0);
+			int x1 = Min(x + 1, sizeX - 1);
+			int z0 = Max(z - 1, 0);
+			int z1 = Min(z + 1, sizeZ - 1);
+			float* point = &values[(z * sizeX + x) * 3];
+			point[1] = (values[(z * sizeX + x1) * 3] - values[(z * sizeX + x0) * 3]) / ((x1 - x0) * cellSize);
+			point[2] = (values[(z1 * sizeX + x) * 3] - values[(z0 * sizeX + x) * 3]) / ((z1 - z0) * cellSize);
+		}
+	}
+}
+
+void TerrainField::Sample(const Vector3* positions, unsigned count, TerrainSample* samples) const
+{
+	if (values.Empty())
+	{
+		for (unsigned i = 0; i < count; ++i)
+		{
+			samples[i].height = -M_INFINITY;
+			samples[i].slopeX = 0.0f;
+			samples[i].slopeZ = 0.0f;
+		}
+		return;
+	}
+
+	const float* data = &values[0];
+	for (unsigned i = 0; i < count; ++i)
+	{
+		float fx = (positions[i].x_ - originX) * invCellSize;
+		float fz = (positions[i].z_ - originZ) * invCellSize;
+		int x = Clamp((int)floorf(fx), 0, sizeX - 2);
+		int z = Clamp((int)floorf(fz), 0, sizeZ - 2);
+		float tx = Clamp(fx - x, 0.0f, 1.0f);
+		float tz = Clamp(fz - z, 0.0f, 1.0f);
+
+		const float* row0 = data + (z * sizeX + x) * 3;
+		const float* row1 = row0 + sizeX * 3;
+		float result[3];
+		for (unsigned j = 0; j < 3; ++j)
+		{
+			float value0 = row0[j] + (row0[j + 3] - row0[j]) * tx;
+			float value1 = row1[j] + (row1[j + 3] - row1[j]) * tx;
+			result[j] = value0 + (value1 - value0) * tz;
+		}
+
+		samples[i].height = result[0];
+		samples[i].slopeX = result[1];
+		samples[i].slopeZ = result[2];
+	}
+}
+
+float TerrainField::Distance(const Vector3& position, const TerrainSample& sample)
+{
+	// Height above a plane with this gradient, scaled to the distance along the plane's normal
+	return (position.y_ - sample.height) / sqrtf(1.0f + sample.slopeX * sample.slopeX + sample.slopeZ * sample.slopeZ);
+}
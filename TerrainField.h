@@ -0,0 +1,53 @@
+#pragma once
+#include <Urho3D/Container/Vector.h>
+#include <Urho3D/Math/Vector3.h>
+
+namespace Urho3D
+{
+	class Terrain;
+}
+
+using namespace Urho3D;
+
+/// Terrain height and slope at one point.
+struct TerrainSample
+{
+	float height;
+	/// Height gradient along world x and z.
+	float slopeX;
+	float slopeZ;
+};
+
+/// Terrain height and slope baked once onto a coarse regular grid, so flocks can stay clear of the ground with a
+/// bilinear lookup per fish instead of a physics raycast. Treating the ground as locally planar also turns the
+/// height above it into an approximate distance.
+class TerrainField
+{
+public:
+	TerrainField();
+
+	/// Sample a terrain over its full extent every cellSize world units. The terrain node is assumed unscaled.
+	void Bake(const Terrain* terrain, float cellSize);
+	/// Interpolate height and slope at count points. Points beyond the field take the value of its nearest edge.
+	/// Thread-safe.
+	void Sample(const Vector3* positions, unsigned count, TerrainSample* samples) const;
+	/// Return the approximate distance of a point above the terrain sampled under it, negative below the surface.
+	static float Distance(const Vector3& position, const TerrainSample& sample);
+
+	bool IsBaked() const { return !values.Empty(); }
+	/// Return the grid spacing of the last bake.
+	float GetCellSize() const { return cellSize; }
+	unsigned GetMemoryUse() const { return values.Size() * sizeof(float); }
+
+private:
+	/// World x and z of the first grid point.
+	float originX;
+	float originZ;
+	float cellSize;
+	float invCellSize;
+	int sizeX;
+	int sizeZ;
+	/// Height, slope x and slope z of each grid point, row by row in z. Interleaved so each of the two rows a lookup
+	/// reads is one contiguous span.
+	PODVector<float> values;
+};
@@ -0,0 +1,228 @@
+#include <Urho3D/Core/CoreEvents.h>
+#include <Urho3D/Core/Profiler.h>
+#include <Urho3D/Graphics/Camera.h>
+#include <Urho3D/Graphics/Graphics.h>
+#include <Urho3D/Graphics/GraphicsEvents.h>
+#include <Urho3D/Graphics/Material.h>
+#include <Urho3D/Graphics/RenderSurface.h>
+#include <Urho3D/Graphics/Texture2D.h>
+#include <Urho3D/Graphics/Viewport.h>
+#include <Urho3D/Scene/Node.h>
+#include <Urho3D/Scene/Scene.h>
+
+#include "WaterReflection.h"
+
+/// One step of reflection quality.
+struct ReflectionQuality
+{
+	int textureSize;
+	/// Render the reflection every this many frames.
+	unsigned updateInterval;
+	bool shadows;
+	float farClip;
+};
+
+/// Quality levels, best first. Each gives up what is least visible on the water first.
+static const ReflectionQuality REFLECTION_QUALITY[] =
+{
+	{ 1024, 1, true, 50.0f },
+	{ 1024, 1, false, 50.0f },
+	{ 512, 1, false, 50.0f },
+	{ 512, 2, false, 35.0f },
+	{ 256, 3, false, 25.0f }
+};
+static const unsigned NUM_REFLECTION_QUALITY_LEVELS = sizeof(REFLECTION_QUALITY) / sizeof(REFLECTION_QUALITY[0]);
+
+/// Length of a measurement window in seconds.
+static const float MEASUREMENT_WINDOW = 0.5f;
+/// Average frame time over the target, as a fraction of it, that drops a level.
+static const float OVERLOAD_TOLERANCE = 0.1f;
+/// Average CPU time under this fraction of the target allows an upgrade, as long as frames are also on target.
+static const float UPGRADE_CPU_HEADROOM = 0.7f;
+/// Seconds a level is held before trying the one above, and the most that grows to after failed upgrades.
+static const float MIN_UPGRADE_DELAY = 2.0f;
+static const float MAX_UPGRADE_DELAY = 30.0f;
+
+WaterReflection::WaterReflection(Context* context) :
+	Object(context),
+	level_(0),
+	targetFrameTime_(1.0f / 60.0f),
+	framesSinceUpdate_(0),
+	frameTimed_(false),
+	windowTime_(0.0f),
+	windowCpuTime_(0.0f),
+	windowReflectionTime_(0.0f),
+	windowFrames_(0),
+	windowReflections_(0),
+	averageFrameTime_(0.0f),
+	averageCpuTime_(0.0f),
+	averageReflectionTime_(0.0f),
+	timeSinceChange_(0.0f),
+	lastChangeUpgrade_(false),
+	upgradeDelay_(MIN_UPGRADE_DELAY)
+{
+}
+
+void WaterReflection::Create(Scene* scene, Node* cameraNode, const Plane& plane, const Plane& clipPlane,
+	Material* material)
+{
+	Graphics* graphics = GetSubsystem<Graphics>();
+
+	reflectionNode_ = cameraNode->CreateChild();
+	Camera* reflectionCamera = reflectionNode_->CreateComponent<Camera>();
+	reflectionCamera->SetViewMask(0x7fffffff); // Hide objects with only bit 31 in the viewmask (the water plane)
+	reflectionCamera->SetAutoAspectRatio(true);
+	reflectionCamera->SetUseReflection(true);
+	reflectionCamera->SetReflectionPlane(plane);
+	reflectionCamera->SetUseClipping(true); // Enable clipping of geometry behind water plane
+	reflectionCamera->SetClipPlane(clipPlane);
+	// The water reflection texture is rectangular. Set reflection camera aspect ratio to match
+	reflectionCamera->SetAspectRatio((float)graphics->GetWidth() / (float)graphics->GetHeight());
+	camera_ = reflectionCamera;
+
+	// Assign the reflection texture to the diffuse texture unit of the water material
+	texture_ = new Texture2D(context_);
+	viewport_ = new Viewport(context_, scene, reflectionCamera);
+	material->SetTexture(TU_DIFFUSE, texture_);
+	ApplyQuality();
+
+	SubscribeToEvent(E_BEGINFRAME, URHO3D_HANDLER(WaterReflection, HandleBeginFrame));
+	SubscribeToEvent(E_ENDRENDERING, URHO3D_HANDLER(WaterReflection, HandleEndRendering));
+	SubscribeToEvent(E_BEGINVIEWRENDER, URHO3D_HANDLER(WaterReflection, HandleBeginViewRender));
+	SubscribeToEvent(E_ENDVIEWRENDER, URHO3D_HANDLER(WaterReflection, HandleEndViewRender));
+}
+
+void WaterReflection::SetQualityLevel(unsigned level)
+{
+	level = Min(level, NUM_REFLECTION_QUALITY_LEVELS - 1);
+	if (level == level_)
+		return;
+
+	level_ = level;
+	ApplyQuality();
+}
+
+unsigned WaterReflection::GetNumQualityLevels() const
+{
+	return NUM_REFLECTION_QUALITY_LEVELS;
+}
+
+void WaterReflection::ApplyQuality()
+{
+	if (!camera_)
+		return;
+
+	const ReflectionQuality& quality = REFLECTION_QUALITY[level_];
+	camera_->SetFarClip(quality.farClip);
+	camera_->SetViewOverrideFlags(quality.shadows ? VO_NONE : VO_DISABLE_SHADOWS);
+
+	// Resizing replaces the render surface, so the viewport and update mode go on the new one
+	if (texture_->GetWidth() != quality.textureSize)
+	{
+		texture_->SetSize(quality.textureSize, quality.textureSize, Graphics::GetRGBFormat(), TEXTURE_RENDERTARGET);
+		texture_->SetFilterMode(FILTER_BILINEAR);
+		texture_->GetRenderSurface()->SetViewport(0, viewport_);
+	}
+	// Rendered whenever the water is visible, or queued by hand every few frames
+	texture_->GetRenderSurface()->SetUpdateMode(quality.updateInterval > 1 ? SURFACE_MANUALUPDATE :
+		SURFACE_UPDATEVISIBLE);
+	framesSinceUpdate_ = quality.updateInterval;
+}
+
+void WaterReflection::Adapt()
+{
+	averageFrameTime_ = windowTime_ / windowFrames_;
+	averageCpuTime_ = windowCpuTime_ / windowFrames_;
+	averageReflectionTime_ = windowReflections_ ? windowReflectionTime_ / windowReflections_ : 0.0f;
+	timeSinceChange_ += windowTime_;
+
+	if (targetFrameTime_ <= 0.0f)
+		return;
+
+	if (averageFrameTime_ > targetFrameTime_ * (1.0f + OVERLOAD_TOLERANCE))
+	{
+		if (level_ + 1 >= NUM_REFLECTION_QUALITY_LEVELS)
+			return;
+		// An upgrade undone this soon was a level the frame could not afford: wait longer before the next try
+		if (lastChangeUpgrade_ && timeSinceChange_ < upgradeDelay_)
+			upgradeDelay_ = Min(upgradeDelay_ * 2.0f, MAX_UPGRADE_DELAY);
+		SetQualityLevel(level_ + 1);
+		lastChangeUpgrade_ = false;
+		timeSinceChange_ = 0.0f;
+	}
+	else if (level_ > 0 && timeSinceChange_ >= upgradeDelay_ &&
+		averageFrameTime_ <= targetFrameTime_ * (1.0f + OVERLOAD_TOLERANCE * 0.5f) &&
+		averageCpuTime_ < targetFrameTime_ * UPGRADE_CPU_HEADROOM)
+	{
+		// An upgrade that held as long as it waited was affordable; the next one need not wait as long
+		if (lastChangeUpgrade_)
+			upgradeDelay_ = Max(upgradeDelay_ * 0.5f, MIN_UPGRADE_DELAY);
+		SetQualityLevel(level_ - 1);
+		lastChangeUpgrade_ = true;
+		timeSinceChange_ = 0.0f;
+	}
+}
+
+void WaterReflection::HandleBeginFrame(StringHash eventType, VariantMap& eventData)
+{
+	using namespace BeginFrame;
+
+	if (frameTimed_)
+	{
+		windowTime_ += eventData[P_TIMESTEP].GetFloat();
+		windowFrames_++;
+		if (windowTime_ >= MEASUREMENT_WINDOW)
+		{
+			Adapt();
+			windowTime_ = 0.0f;
+			windowCpuTime_ = 0.0f;
+			windowReflectionTime_ = 0.0f;
+			windowFrames_ = 0;
+			windowReflections_ = 0;
+		}
+	}
+	frameTimer_.Reset();
+	frameTimed_ = false;
+
+	const ReflectionQuality& quality = REFLECTION_QUALITY[level_];
+	if (texture_ && quality.updateInterval > 1 && ++framesSinceUpdate_ >= quality.updateInterval)
+	{
+		texture_->GetRenderSurface()->QueueUpdate();
+		framesSinceUpdate_ = 0;
+	}
+}
+
+void WaterReflection::HandleEndRendering(StringHash eventType, VariantMap& eventData)
+{
+	// The whole frame is measured from one frame start to the next; this is the part the CPU spends before presenting
+	windowCpuTime_ += frameTimer_.GetUSec(false) / 1000000.0f;
+	frameTimed_ = true;
+}
+
+void WaterReflection::HandleBeginViewRender(StringHash eventType, VariantMap& eventData)
+{
+	using namespace BeginViewRender;
+
+	if (!camera_ || eventData[P_CAMERA].GetPtr() != camera_)
+		return;
+
+	// The reflection is an ordinary render-to-texture view; give it its own profiler block so it can be told apart
+	Profiler* profiler = GetSubsystem<Profiler>();
+	if (profiler)
+		profiler->BeginBlock("WaterReflection");
+	viewTimer_.Reset();
+}
+
+void WaterReflection::HandleEndViewRender(StringHash eventType, VariantMap& eventData)
+{
+	using namespace EndViewRender;
+
+	if (!camera_ || eventData[P_CAMERA].GetPtr() != camera_)
+		return;
+
+	windowReflectionTime_ += viewTimer_.GetUSec(false) / 1000000.0f;
+	windowReflections_++;
+	Profiler* profiler = GetSubsystem<Profiler>();
+	if (profiler)
+		profiler->EndBlock();
+}
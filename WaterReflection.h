@@ -0,0 +1,90 @@
+#pragma once
+#include <Urho3D/Core/Object.h>
+#include <Urho3D/Core/Timer.h>
+#include <Urho3D/Math/Plane.h>
+
+namespace Urho3D
+{
+	class Camera;
+	class Material;
+	class Node;
+	class Scene;
+	class Texture2D;
+	class Viewport;
+}
+
+using namespace Urho3D;
+
+/// Renders a planar water reflection into a material's diffuse texture, and trades its quality for frame time. The
+/// quality levels, best first, lower the texture resolution, render the reflection only every few frames, turn off
+/// its shadows and pull in its far clip so distant geometry is skipped.
+///
+/// The controller measures the whole frame time and the CPU time of each frame up to the end of rendering, averaged
+/// over half a second. Urho3D exposes no GPU timers; a GPU-bound frame shows up in the whole frame time instead,
+/// because presenting waits for the GPU. A frame over the target drops a level. A level is regained only when
+/// frames are on target with CPU time to spare, and an upgrade that has to be undone makes the next one wait longer,
+/// so the controller does not oscillate between two levels.
+class WaterReflection : public Object
+{
+	URHO3D_OBJECT(WaterReflection, Object);
+
+public:
+	/// Construct.
+	WaterReflection(Context* context);
+
+	/// Create the reflection camera under cameraNode, reflecting the scene in plane and clipping below clipPlane,
+	/// and assign its texture to the diffuse unit of material.
+	void Create(Scene* scene, Node* cameraNode, const Plane& plane, const Plane& clipPlane, Material* material);
+	/// Set the frame time to hold, in seconds. 0 stops adapting and keeps the current level.
+	void SetTargetFrameTime(float seconds) { targetFrameTime_ = Max(seconds, 0.0f); }
+	/// Set the quality level, 0 being the best.
+	void SetQualityLevel(unsigned level);
+	unsigned GetQualityLevel() const { return level_; }
+	unsigned GetNumQualityLevels() const;
+
+	/// Return the averages of the last measurement window, in seconds.
+	float GetAverageFrameTime() const { return averageFrameTime_; }
+	float GetAverageCpuTime() const { return averageCpuTime_; }
+	/// Return the average CPU time of one reflection view, in seconds.
+	float GetAverageReflectionTime() const { return averageReflectionTime_; }
+
+private:
+	/// Apply the current level to the camera and texture.
+	void ApplyQuality();
+	/// Change level from the measurements of a finished window.
+	void Adapt();
+	/// Measure the last frame, adapt at the end of a window and queue the reflection when it is due.
+	void HandleBeginFrame(StringHash eventType, VariantMap& eventData);
+	void HandleEndRendering(StringHash eventType, VariantMap& eventData);
+	/// Time the reflection view and give it its own profiler block.
+	void HandleBeginViewRender(StringHash eventType, VariantMap& eventData);
+	void HandleEndViewRender(StringHash eventType, VariantMap& eventData);
+
+	SharedPtr<Node> reflectionNode_;
+	SharedPtr<Texture2D> texture_;
+	SharedPtr<Viewport> viewport_;
+	WeakPtr<Camera> camera_;
+	unsigned level_;
+	float targetFrameTime_;
+	/// Frames since the reflection was last queued.
+	unsigned framesSinceUpdate_;
+
+	HiresTimer frameTimer_;
+	HiresTimer viewTimer_;
+	bool frameTimed_;
+	/// Sums over the current measurement window.
+	float windowTime_;
+	float windowCpuTime_;
+	float windowReflectionTime_;
+	unsigned windowFrames_;
+	unsigned windowReflections_;
+	float averageFrameTime_;
+	float averageCpuTime_;
+	float averageReflectionTime_;
+
+	/// Seconds since the level last changed, whether that change was an upgrade, and how long the next upgrade must
+	/// wait.
+	float timeSinceChange_;
+	bool lastChangeUpgrade_;
+	float upgradeDelay_;
+};